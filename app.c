@@ -1,4 +1,9 @@
 /*** includes ***/
+// feature test macros have to come before any system header
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+#define _BSD_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -8,30 +13,91 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define INDEX_AVX2 // AVX2 newline and substring scanners picked at runtime
+#endif
 
 /*** Defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f) // Macro to mimic ctrl key from the keyboard
 #define EDITOR_VERSION "0.0.1"
-#define _DEFAULT_SOURCE
-#define _GNU_SOURCE
-#define _BSD_SOURCE
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define ESC_SEQ_TIMEOUT 50 // ms to wait for the rest of an escape sequence
+
+// the mtime of a struct stat as a timespec, macOS has its own name for it
+#ifdef __APPLE__
+#define STAT_MTIM(st) ((st).st_mtimespec)
+#else
+#define STAT_MTIM(st) ((st).st_mtim)
+#endif
 
 /*** Data ***/
 
+#define ROW_INLINE_CAP 24 // rows shorter than this keep their text inside the erow
+
 // A structure to store the text present in the editor 
+// (64 bytes, so walking E.row reads one cache line per row)
 typedef struct erow{
-    int size;
+    int size; // number of characters in the row
     int rsize;
-    char* chars;
-    char* render;
+    int gap; // start of the gap inside chars
+    int cap; // allocated size of chars
+    int rcap; // allocated size of render
+    unsigned char flags; // ROW_*
+    long long off; // where the row starts in the file as of the last save
+    char* render; // owned copy, NULL when the render is the text itself
+    union {
+        char* ptr; // heap buffer, or into E.map until the row is first edited
+        char buf[ROW_INLINE_CAP]; // ROW_INLINE
+    } chars; // use ROW_CHARS(row)
 } erow;
 
+#define ROW_DIRTY 1 // differs from the file on disk
+#define ROW_STALE 2 // chars changed since render was built (or never rendered)
+#define ROW_INLINE 4 // text is in chars.buf, moves whenever E.row does
+#define ROW_ALIAS 8 // no tabs, the render is just the text
+
+struct findMatch {
+    int row, col;
+} typedef findMatch;
+
+// an operation and its inverse differ only in the lowest bit
+#define UNDO_INSERT 0 // len characters of text went in at row y, column x
+#define UNDO_DELETE 1 // the len characters of text at row y, column x went
+#define UNDO_INSROWS 2 // n rows went in at row y
+#define UNDO_DELROWS 3 // n rows at row y went, text holds them
+#define UNDO_MOVE 4 // n rows moved from row y to row x
+
+#define UNDO_STEP 1 // first record of a step
+#define UNDO_TYPED 2 // single characters typed or deleted, may still grow
+
+// one row operation in the undo log
+struct undoRec {
+    unsigned char op;
+    unsigned char flags;
+    int y, x, n;
+    int cy, cx, ay, ax; // cursor before and after the step, on its first record
+    char* text;
+    int len, cap;
+} typedef undoRec;
+
 
 // A global variable for storing state of our editor
 struct editorConfig {
@@ -49,17 +115,79 @@ struct editorConfig {
 
     int numrows; // number of rows with text in current file
     erow *row; // array of row data
+    int rowgap, rowcap; // E.row has room for rowcap rows, the unused ones at rowgap
+    int gaprow; // the only row whose gap may not be at the end, -1 if none
+    int rlo, rhi; // rows outside [rlo, rhi) have no render allocated
+
+    char* map; // read only mapping of the opened file
+    size_t maplen;
+    int mapsame; // the mapping is of the file currently on disk
+
+    // what the file on disk looks like, so saves can rewrite only what changed
+    int diskexact; // file holds exactly the rows at their off, each ending in '\n'
+    long long disksize;
+    dev_t diskdev;
+    ino_t diskino;
+    struct timespec diskmtime; // to tell a rewrite of the same size
+    int firstdirty; // lowest row changed since the last save, INT_MAX if none
+    int rowsmoved; // rows were inserted or deleted since the last save
+    int* dirtyrows; // rows marked ROW_DIRTY, kept only while !rowsmoved
+    int ndirtyrows, dirtyrowscap;
+
+    // byte offsets of rows, see Line offsets
+    long long* blocklen;
+    long long* linetree;
+    int linevalid, linecap; // blocks before linevalid are up to date
 
     int rowoff; // row offset for scrolling
     int coloff; // column offset for horizontal scrolling
 
     char* filename; // to store filename
 
-    char statusmsg[80]; // for status messages
+    char statusmsg[256]; // for status messages, cut to the screen width
     char statusmsg_time;
 
     int dirty;// bit to keep track of data loaded into the editor
 
+    int headless; // --script or --bench, there is no terminal
+
+    // shadow of the terminal contents, (screenrows + 2) lines of screencols cells
+    char* shadow;
+    unsigned char* shadowattr;
+    int shadowvalid; // 0 until the terminal has been cleared to match it
+    int shadowrowoff, shadowcoloff; // scroll offsets the shadow was drawn with
+    char* line; // screen line being composed
+    unsigned char* lineattr;
+    int linelen;
+
+    size_t framebytes; // bytes written by the last frame
+    unsigned long long outbytes; // bytes written by all frames
+    unsigned long frames;
+
+    // performance HUD (Ctrl-P) and per-frame CSV (--metrics FILE),
+    // frames are only timed while one of them is on
+    int hud;
+    FILE* metrics;
+    long long inputus; // when the oldest key not yet painted was read, 0 if none
+    long long renderus; // time the last frame took to build
+    long long latencyus; // from reading a key to painting the frame with it
+    unsigned long nreads, nwrites; // read and write calls on the terminal
+
+    int findrow, findcol, findlen; // search match to highlight, findlen 0 if none
+    findMatch* found; // matches of the last find all, in order, until the next edit
+    size_t nfound;
+    int foundlen;
+
+    // undo log, see Undo
+    undoRec* undo;
+    int undohead, undopos, nundo, undoslots; // live records, those before undopos done
+    int undostep; // first record of the open step
+    int undoopen; // records go into the step at undostep
+    int undoing; // nothing is recorded while a record is applied
+    int undolost; // the open step did not fit, skip the rest of it
+    int undocy, undocx; // cursor when the current key press started
+    size_t undobytes, undomax; // bytes held by the records and the most they may hold
+
 } typedef editorConfig;
 
 editorConfig E;
@@ -75,22 +203,179 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START, // ESC [ 200 ~, only seen by editorReadKey
+    PASTE // a whole bracketed paste, the text is in pastebuf
 };
 
 /***  Prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt);
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorWaitEvent(int timeout_ms);
+int editorWaitInput(int timeout_ms);
+int editorReadByte(char* c, int timeout_ms);
+void undoInsert(int y, int x, const char* s, int len, int typed);
+void undoDelete(erow* row, int x, int len, int typed);
+void undoInsertRows(int y, int n);
+void undoDeleteRows(int y, int n);
+void undoMoveRows(int from, int n, int to);
+long long editorNowUs();
+void screenResize();
+void initEditor();
+void undoClear();
+void journalAdd(int op, int y, int x, int n, const char* text);
+void journalOpen(int replay);
+void journalClose(int drop);
+long editorReplaceAll(const char* old, int oldlen, const char* new, int newlen);
+void die(const char* s);
+int slabSummary(char* buf, size_t len);
+
+/*** Memory accounting ***/
+// Heap use by subsystem
+
+/* Allocations go through memAlloc/memRealloc/memFree with the subsystem
+they belong to. A header in front of every block remembers its size and
+tag, so memRealloc and memFree need neither. Row text and renders are
+slab blocks, slabAlloc and slabFree account for those with memCount. */
+
+enum memTag {
+    MEM_ROWS, // E.row and the text of the rows
+    MEM_RENDER,
+    MEM_ABUF,
+    MEM_SCREEN, // shadow of the terminal
+    MEM_INPUT, // paste buffer
+    MEM_PROMPT,
+    MEM_FILE, // file I/O
+    MEM_SEARCH, // find all results
+    MEM_UNDO,
+    MEM_TAGS
+};
+
+static const char* memTagNames[MEM_TAGS] = {
+    "rows", "render", "abuf", "screen", "input", "prompt", "file", "search", "undo"
+};
+
+struct memStats {
+    size_t live; // bytes allocated now
+    size_t peak;
+    unsigned long allocs; // allocations and reallocations
+};
+
+static struct memStats memstats[MEM_TAGS];
+static FILE* memdump = NULL; // --memstats FILE, written at exit
+
+// 16 bytes, so blocks keep malloc's alignment
+typedef struct {
+    size_t size;
+    size_t tag;
+} memHeader;
+
+// account for delta bytes of tag allocated (or freed if negative) elsewhere
+void memCount(int tag, long long delta)
+{
+    memstats[tag].live += delta;
+    if (delta > 0)
+    {
+        memstats[tag].allocs++;
+        if (memstats[tag].live > memstats[tag].peak)
+            memstats[tag].peak = memstats[tag].live;
+    }
+}
+
+void* memAlloc(int tag, size_t n)
+{
+    memHeader* h = malloc(sizeof(memHeader) + n);
+    if (h == NULL)
+        die("malloc");
+    h->size = n;
+    h->tag = tag;
+    memCount(tag, n);
+    return h + 1;
+}
+
+// resize a block from memAlloc, p may be NULL
+void* memRealloc(int tag, void* p, size_t n)
+{
+    if (p == NULL)
+        return memAlloc(tag, n);
+    memHeader* h = (memHeader*)p - 1;
+    size_t old = h->size;
+    h = realloc(h, sizeof(memHeader) + n);
+    if (h == NULL)
+        die("realloc");
+    h->size = n;
+    memstats[h->tag].live -= old;
+    memCount(h->tag, n);
+    return h + 1;
+}
+
+void memFree(void* p)
+{
+    if (p == NULL)
+        return;
+    memHeader* h = (memHeader*)p - 1;
+    memstats[h->tag].live -= h->size;
+    free(h);
+}
+
+// n bytes for people: 512, 1.5K, 20.0M
+static const char* memHuman(char* buf, size_t len, size_t n)
+{
+    if (n < 1024)
+        snprintf(buf, len, "%zu", n);
+    else if (n < 1024 * 1024)
+        snprintf(buf, len, "%.1fK", n / 1024.0);
+    else if (n < 1024 * 1024 * 1024)
+        snprintf(buf, len, "%.1fM", n / (1024.0 * 1024));
+    else
+        snprintf(buf, len, "%.1fG", n / (1024.0 * 1024 * 1024));
+    return buf;
+}
+
+// one line summary, live(peak) bytes of every subsystem
+void memSummary(char* buf, size_t len)
+{
+    size_t used = snprintf(buf, len, "mem");
+    int i;
+    for (i = 0; i < MEM_TAGS && used < len; i++)
+    {
+        char live[16], peak[16];
+        used += snprintf(&buf[used], len - used, " %s %s(%s)", memTagNames[i],
+                         memHuman(live, sizeof(live), memstats[i].live),
+                         memHuman(peak, sizeof(peak), memstats[i].peak));
+    }
+    if (used < len)
+        buf[used++] = ' ';
+    if (used < len)
+        slabSummary(&buf[used], len - used);
+}
+
+// atexit handler for --memstats
+void memDump()
+{
+    int i;
+    fprintf(memdump, "%-10s %14s %14s %12s\n", "subsystem", "live", "peak", "allocs");
+    for (i = 0; i < MEM_TAGS; i++)
+        fprintf(memdump, "%-10s %14zu %14zu %12lu\n", memTagNames[i],
+                memstats[i].live, memstats[i].peak, memstats[i].allocs);
+    char slabline[80];
+    slabSummary(slabline, sizeof(slabline));
+    fprintf(memdump, "%s\n", slabline);
+    fclose(memdump);
+}
 
 /*** Terminal ***/
 
 // Custom error handling function
 void die(const char* s)
 {
-    write(STDOUT_FILENO,"\x1b[2J",4);
-    write(STDOUT_FILENO,"\x1b[H",3);
+    if (!E.headless)
+    {
+        write(STDOUT_FILENO,"\x1b[2J",4);
+        write(STDOUT_FILENO,"\x1b[H",3);
+    }
 
     perror(s);
     exit(1);
@@ -101,6 +386,8 @@ setting the terminal back to its original attributes(Canonical Mode)
 */
 void disableRawMode()
 {
+    // turn bracketed paste off again
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.original_terminal) == -1)
         die("tcsetattr");
 }
@@ -124,80 +411,247 @@ void enableRawMode()
     raw_terminal.c_oflag &= ~(OPOST);
     raw_terminal.c_cflag |= (CS8);
     raw_terminal.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    // read() never blocks, the event loop polls stdin before reading
     raw_terminal.c_cc[VMIN] = 0; // minimum number of bytess input before read() returns
-    raw_terminal.c_cc[VTIME] = 1; // minimum amount of time before read() returns
+    raw_terminal.c_cc[VTIME] = 0; // minimum amount of time before read() returns
 
     // A function to apply the modified changes
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw_terminal) == -1)
         die("tcsetattr");
+
+    // ask the terminal to wrap pasted text in ESC [ 200 ~ ... ESC [ 201 ~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-// A function for reading the key presses and return the characters pressed
-int editorReadKey()
+/* Keyboard input is read into a ring buffer, taking everything the
+terminal has in one read(), and keys are decoded from the buffer.
+A key that is cut in the middle of an escape sequence stays in the
+buffer until the rest arrives (or ESC_SEQ_TIMEOUT runs out). */
+
+#define INPUT_BUF_SIZE 4096 // must be a power of two
+
+static unsigned char inbuf[INPUT_BUF_SIZE];
+static unsigned inhead = 0, intail = 0; // free running, masked on access
+
+#define INPUT_LEN() (intail - inhead)
+#define INPUT_AT(i) (inbuf[(inhead + (i)) & (INPUT_BUF_SIZE - 1)])
+
+#define PASTE_TIMEOUT 1000 // ms of silence after which a paste is taken as finished
+
+// text of the last bracketed paste
+static char* pastebuf = NULL;
+static size_t pastelen = 0, pastecap = 0;
+
+// a recorded trace replayed instead of the terminal (--bench), NULL if none
+static const char* tracebuf = NULL;
+static size_t tracelen = 0, tracepos = 0;
+
+// readv() from the trace, never blocks
+static ssize_t inputReadTrace(struct iovec* iov, int cnt)
+{
+    ssize_t n = 0;
+    int i;
+    for (i = 0; i < cnt && tracepos < tracelen; i++)
+    {
+        size_t k = tracelen - tracepos;
+        if (k > iov[i].iov_len)
+            k = iov[i].iov_len;
+        memcpy(iov[i].iov_base, &tracebuf[tracepos], k);
+        tracepos += k;
+        n += k;
+    }
+    return n;
+}
+
+// read whatever the terminal has into the ring, returns the bytes read
+int inputFill()
 {
-    int nread;
+    unsigned free = INPUT_BUF_SIZE - INPUT_LEN();
+    if (free == 0)
+        return 0;
+
+    // the free space may wrap around the end of the ring
+    struct iovec iov[2];
+    unsigned start = intail & (INPUT_BUF_SIZE - 1);
+    unsigned first = INPUT_BUF_SIZE - start;
+    if (first > free)
+        first = free;
+    iov[0].iov_base = &inbuf[start];
+    iov[0].iov_len = first;
+    iov[1].iov_base = inbuf;
+    iov[1].iov_len = free - first;
+
+    ssize_t n;
+    if (tracebuf != NULL)
+        n = inputReadTrace(iov, free > first ? 2 : 1);
+    else
+        n = readv(STDIN_FILENO, iov, free > first ? 2 : 1);
+    if (n == -1 && errno != EAGAIN && errno != EINTR)
+        die("read");
+    if (n <= 0)
+        return 0;
+    if (tracebuf == NULL)
+        E.nreads++;
+    if ((E.hud || E.metrics) && E.inputus == 0)
+        E.inputus = editorNowUs();
+    intail += n;
+    return n;
+}
+
+// anything left to decode?
+int inputPending()
+{
+    return INPUT_LEN() > 0;
+}
+
+/* Decode one key from the ring. Returns the number of bytes it used, or 0
+when the buffer ends in the middle of an escape sequence. */
+static int inputDecode(int* key)
+{
+    unsigned len = INPUT_LEN();
+    if (len == 0)
+        return 0;
+
+    unsigned char c = INPUT_AT(0);
+    // when read characters are usual characters
+    if (c != '\x1b')
+    {
+        *key = c;
+        return 1;
+    }
 
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) 
-        if (nread == -1 && errno != EAGAIN) die("read");
-    
     // when the read characters are escape sequences
-    if(c=='\x1b')
+    *key = '\x1b';
+    if (len < 2)
+        return 0;
+    unsigned char kind = INPUT_AT(1);
+
+    if (kind == 'O')
     {
-        char seq[3];
+        if (len < 3)
+            return 0;
+        switch (INPUT_AT(2))
+        {
+            case 'H': *key = HOME_KEY; break;
+            case 'F': *key = END_KEY; break;
+        }
+        return 3;
+    }
+    if (kind != '[')
+        return 2;
 
-        // if nothing after that, return the escape seq only
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) 
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) 
-            return '\x1b';
-        
-        if (seq[0] == '[') 
+    // CSI: parameter bytes, then one final byte
+    unsigned i = 2;
+    int param = 0, nparam = 0;
+    while (i < len && INPUT_AT(i) >= 0x20 && INPUT_AT(i) <= 0x3f)
+    {
+        if (isdigit(INPUT_AT(i)))
         {
-            if (seq[1] >= '0' && seq[1] <= '9') 
-            {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) 
-                    return '\x1b';
-                if (seq[2] == '~') 
-                {
-                    switch (seq[1])
-                    {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            } 
-            else 
+            param = param * 10 + (INPUT_AT(i) - '0');
+            if (nparam == 0)
+                nparam = 1;
+        }
+        else
+            nparam = 100; // several parameters, none of our keys
+        i++;
+    }
+    if (i == len)
+        return 0;
+    unsigned char final = INPUT_AT(i);
+
+    if (final == '~' && nparam == 1)
+    {
+        switch (param)
+        {
+            case 200: *key = PASTE_START; break;
+            case 1: *key = HOME_KEY; break;
+            case 3: *key = DEL_KEY; break;
+            case 4: *key = END_KEY; break;
+            case 5: *key = PAGE_UP; break;
+            case 6: *key = PAGE_DOWN; break;
+            case 7: *key = HOME_KEY; break;
+            case 8: *key = END_KEY; break;
+        }
+    }
+    else if (nparam == 0)
+    {
+        switch (final)
+        {
+            case 'A': *key = ARROW_UP; break;
+            case 'B': *key = ARROW_DOWN; break;
+            case 'C': *key = ARROW_RIGHT; break;
+            case 'D': *key = ARROW_LEFT; break;
+            case 'H': *key = HOME_KEY; break;
+            case 'F': *key = END_KEY; break;
+        }
+    }
+    return i + 1;
+}
+
+// move a bracketed paste from the input into pastebuf, up to ESC [ 201 ~
+static void inputReadPaste()
+{
+    static const char end[] = "\x1b[201~";
+    int endlen = sizeof(end) - 1;
+    pastelen = 0;
+    while (1)
+    {
+        while (inputPending())
+        {
+            if (pastelen == pastecap)
             {
-                switch (seq[1]) 
-                {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
+                pastecap = pastecap ? pastecap * 2 : 4096;
+                pastebuf = memRealloc(MEM_INPUT, pastebuf, pastecap);
             }
-        } 
-        else if (seq[0] == 'O')     
-        {
-            switch (seq[1]) 
+            char c = INPUT_AT(0);
+            inhead++;
+            pastebuf[pastelen++] = c;
+            if (c == '~' && pastelen >= (size_t)endlen &&
+                memcmp(&pastebuf[pastelen - endlen], end, endlen) == 0)
             {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
+                pastelen -= endlen;
+                return;
             }
         }
-        return '\x1b';
+        // the end marker got lost, keep what we have
+        if (!editorWaitInput(PASTE_TIMEOUT) || inputFill() == 0)
+            return;
     }
-    // when read characters are usual characters
-    else
-        return c;
+}
+
+// A function for reading the key presses and return the characters pressed
+int editorReadKey()
+{
+    int key;
+    int used;
+    while ((used = inputDecode(&key)) == 0)
+    {
+        if (inputPending())
+        {
+            // half an escape sequence: give the rest a moment to arrive,
+            // otherwise it was just the escape key
+            if (editorWaitInput(ESC_SEQ_TIMEOUT) && inputFill() > 0)
+                continue;
+            inhead++;
+            return '\x1b';
+        }
+        // a trace that ends in a prompt, escape out of it
+        if (tracebuf != NULL && tracepos == tracelen)
+            return '\x1b';
+
+        // sleep until a key arrives, repainting after resizes and timers
+        if (!editorWaitEvent(-1))
+            editorRefreshScreen();
+        else
+            inputFill();
+    }
+    inhead += used;
+    if (key == PASTE_START)
+    {
+        inputReadPaste();
+        return PASTE;
+    }
+    return key;
 }
 
 // to get the cursor position
@@ -214,7 +668,7 @@ int getCursorPosition(int *rows, int* cols)
     // to handle the reply of the above status report obtained
     while(i<sizeof(buff)-1)
     {
-        if(read(STDIN_FILENO, &buff[i], 1) != 1) 
+        if(!editorReadByte(&buff[i], 1000)) 
             return -1;
 
         if(buff[i]=='R')
@@ -249,7 +703,7 @@ int getWindowSize(int *rows, int* cols)
             return -1;
 
         // fallback mechanism for getting window size
-        return getCursorPosition(&E.screenrows,&E.screencols);
+        return getCursorPosition(rows,cols);
     }
     else
     {
@@ -260,307 +714,3583 @@ int getWindowSize(int *rows, int* cols)
 }
 
 
-/*** Row Operations ***/
-// These are about the row buffer 
+/*** Event loop ***/
+/* The editor sleeps in poll() until there is input, a resize or a timer
+to run: stdin, a self-pipe written by the SIGWINCH handler and the
+nearest timer deadline are all multiplexed in editorWaitEvent. */
 
-// copy all characters into the render of a row
-void editorUpdateRow(erow *row) 
+#define EDITOR_MAX_TIMERS 8
+
+struct editorTimer
 {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
+    void (*fn)(void); // NULL when the slot is free
+    int interval; // milliseconds between runs
+    long long due; // next run, on the monotonic clock in milliseconds
+} typedef editorTimer;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+static editorTimer timers[EDITOR_MAX_TIMERS];
+static int sigpipe[2] = {-1, -1};
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) 
+long long editorNowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long editorNowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// run fn every interval_ms milliseconds from the event loop, returns the timer id
+int editorAddTimer(int interval_ms, void (*fn)(void))
+{
+    int i;
+    for (i = 0; i < EDITOR_MAX_TIMERS; i++)
     {
-        if (row->chars[j] == '\t') 
+        if (timers[i].fn == NULL)
         {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } 
-        else 
-        {
-            row->render[idx++] = row->chars[j];
+            timers[i].fn = fn;
+            timers[i].interval = interval_ms;
+            timers[i].due = editorNowMs() + interval_ms;
+            return i;
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    return -1;
 }
 
-// making changes in a certain row in the buffer
-void editorRowInsertChar(erow* row, int at, int c)
+void editorRemoveTimer(int id)
 {
-    if(at < 0 || at > row->size)
-        at = row->size;
-
-    row->chars = realloc(row->chars, row->size+2);
+    if (id >= 0 && id < EDITOR_MAX_TIMERS)
+        timers[id].fn = NULL;
+}
 
-    // basically all character at and beyound at are moved 1 index further to accomodate the new character
-    memmove(&row->chars[at+1], &row->chars[at], row->size -at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+static void handleSigwinch(int sig)
+{
+    (void)sig;
+    int saved = errno;
+    if (write(sigpipe[1], "w", 1) == -1) {} // a full pipe already has a resize pending
+    errno = saved;
 }
 
-int editorRowCxToRx(erow* row, int cx)
+// set up the resize notification pipe
+void editorInitEvents()
 {
-    int rx = 0;
-    int j;
-    for(j=0;j<cx;j++)
+    if (pipe(sigpipe) == -1)
+        die("pipe");
+    int i;
+    for (i = 0; i < 2; i++)
     {
-        if(row->chars[j]=='\t')
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        rx++;
+        fcntl(sigpipe[i], F_SETFL, fcntl(sigpipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC);
     }
-    return rx;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigwinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1)
+        die("sigaction");
 }
 
-// initialising each row in the editor
-void editorInsertRow(int at, char *s, size_t len) 
+// pick up the new terminal size and repaint everything at the next refresh
+void editorHandleResize()
 {
-    if (at < 0 || at > E.numrows) return;
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1)
+        return;
+    E.screenrows = rows - 2;
+    E.screencols = cols;
+    screenResize();
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+/* Sleep until stdin is readable, running timers and handling resizes in
+the meantime. Returns 1 when input is ready and 0 when something else
+happened (the screen may need a refresh) or timeout_ms (-1: no limit) ran out. */
+int editorWaitEvent(int timeout_ms)
+{
+    if (tracebuf != NULL)
+        return tracepos < tracelen;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+    long long now = editorNowMs();
+    int wait = timeout_ms;
+    int i;
+    for (i = 0; i < EDITOR_MAX_TIMERS; i++)
+    {
+        if (timers[i].fn == NULL)
+            continue;
+        long long left = timers[i].due - now;
+        if (left < 0)
+            left = 0;
+        if (wait < 0 || left < wait)
+            wait = left;
+    }
 
-    E.numrows++;
-    E.dirty++;
-}
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = sigpipe[0];
+    fds[1].events = POLLIN;
+    int n = poll(fds, sigpipe[0] == -1 ? 1 : 2, wait);
+    if (n == -1 && errno != EINTR)
+        die("poll");
+
+    int ready = n > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR));
+    if (n > 0 && sigpipe[0] != -1 && (fds[1].revents & POLLIN))
+    {
+        char drain[64];
+        while (read(sigpipe[0], drain, sizeof(drain)) > 0)
+            ;
+        editorHandleResize();
+    }
 
-void editorFreeRow(erow* row)
-{
-    free(row->render);
-    free(row->chars);
+    now = editorNowMs();
+    for (i = 0; i < EDITOR_MAX_TIMERS; i++)
+    {
+        if (timers[i].fn != NULL && timers[i].due <= now)
+        {
+            timers[i].due = now + timers[i].interval;
+            timers[i].fn();
+        }
+    }
+    return ready;
 }
 
-void editorDelRow(int at)
+// wait at most timeout_ms for stdin to become readable, nothing else runs meanwhile
+int editorWaitInput(int timeout_ms)
 {
-    if(at < 0 || at >=E.numrows)
-        return ;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at+1], sizeof(erow)*(E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;    
-}
+    if (tracebuf != NULL)
+        return tracepos < tracelen;
 
-void editorRowDelChar(erow* row,int at)
-{
-    if(at < 0 || at >=row->size)
-        return ;
-    memmove(&row->chars[at], &row->chars[at+1],row->size - 1);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeout_ms) > 0;
 }
 
-void editorRowAppendString(erow* row, char* s, size_t len)
+// take one raw byte from the input buffer, waiting at most timeout_ms for it
+int editorReadByte(char* c, int timeout_ms)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    if (!inputPending() && !(editorWaitInput(timeout_ms) && inputFill() > 0))
+        return 0;
+    *c = INPUT_AT(0);
+    inhead++;
+    return 1;
 }
 
 
+/*** Row memory ***/
+// Size-class allocator for row text and render buffers
 
+/* Buffers of up to SLAB_MAX bytes are rounded up to a power of two size
+class and cut from SLAB_ARENA sized arenas with a bump pointer, so
+loading a file is little more than pointer arithmetic. A released block
+goes on the free list of its class and is handed out again before the
+arena is touched. Rows always know the size of their buffers (cap and
+rcap are the class sizes), so blocks carry no header. Bigger buffers come
+from malloc. slabReset() gives all arenas back at once when the buffer
+is closed. */
 
-/*** file I/O ***/
+#define SLAB_MIN 32
+#define SLAB_MAX 4096
+#define SLAB_CLASSES 8 // 32, 64, ... SLAB_MAX
+#define SLAB_ARENA (1 << 20)
 
-// combining the characters in all the rows as one continuous string
-char* editorRowsToString(int *buflen)
+struct slabStats {
+    size_t reserved; // bytes of arenas taken from malloc
+    size_t used; // bytes in blocks handed out, including big ones
+    size_t wasted; // bytes in blocks sitting on free lists and in arena tails left behind
+};
+
+static struct {
+    void* free[SLAB_CLASSES]; // singly linked through the first word of each block
+    char* bump; // next unused byte of the current arena
+    char* end;
+    void* arenas; // every arena, linked through its first word
+    struct slabStats st;
+    size_t tagged[MEM_TAGS]; // bytes of arena blocks in use by each subsystem
+} slab;
+
+// share of the memory cut from arenas that is not in use
+double slabFragmentation()
 {
-    int totlen = 0;
-    int j;
-    for(j=0;j<E.numrows;j++)
-        totlen += E.row[j].size + 1;
-    
-    *buflen = totlen;
-    
-    char* buf = malloc(totlen);
-    char* p = buf;
-    for(j=0;j<E.numrows;j++)
+    size_t carved = slab.st.reserved - (slab.end - slab.bump);
+    return carved ? (double)slab.st.wasted / carved : 0.0;
+}
+
+// size class for a buffer of n bytes, -1 if it is too big for one
+static int slabClass(int n)
+{
+    int c = 0;
+    int size = SLAB_MIN;
+    while (size < n)
     {
-        memcpy(p,E.row[j].chars,E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+        size *= 2;
+        c++;
     }
-    return buf;
+    return c < SLAB_CLASSES ? c : -1;
 }
 
-void editorOpen(char* filename)
+// a buffer of at least n bytes for tag, *cap is set to its real size
+char* slabAlloc(int tag, int n, int* cap)
 {
-    free(E.filename);
-    E.filename = strdup(filename);
+    int c = slabClass(n);
+    if (c == -1)
+    {
+        char* p = malloc(n);
+        if (p == NULL)
+            die("malloc");
+        *cap = n;
+        slab.st.used += n;
+        memCount(tag, n);
+        return p;
+    }
 
-    // reading input from a file
-    FILE *fp = fopen(filename, "r");
-    if(!(fp))
-        die("fopen"); // error message
+    int size = SLAB_MIN << c;
+    *cap = size;
+    slab.st.used += size;
+    slab.tagged[tag] += size;
+    memCount(tag, size);
+    if (slab.free[c] != NULL)
+    {
+        char* p = slab.free[c];
+        memcpy(&slab.free[c], p, sizeof(void*));
+        slab.st.wasted -= size;
+        return p;
+    }
 
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    if (slab.end - slab.bump < size)
     {
-        while(linelen > 0 && (line[linelen-1]=='\n' || line[linelen-1]=='\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+        // the tail of the old arena is too small, it is simply left unused
+        slab.st.wasted += slab.end - slab.bump;
+        char* arena = malloc(SLAB_ARENA);
+        if (arena == NULL)
+            die("malloc");
+        memcpy(arena, &slab.arenas, sizeof(void*));
+        slab.arenas = arena;
+        slab.bump = arena + SLAB_MIN;
+        slab.end = arena + SLAB_ARENA;
+        slab.st.reserved += SLAB_ARENA;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    char* p = slab.bump;
+    slab.bump += size;
+    return p;
 }
 
-// to save contents into the file
-void editorSave()
+// give back a buffer of cap bytes from slabAlloc
+void slabFree(int tag, char* p, int cap)
 {
-    if(E.filename == NULL)
+    if (p == NULL)
+        return;
+    slab.st.used -= cap;
+    memCount(tag, -cap);
+    int c = slabClass(cap);
+    if (c == -1)
     {
-        E.filename = editorPrompt("Save as : %s");
-        if (E.filename == NULL) 
-        {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
+        free(p);
+        return;
     }
+    slab.tagged[tag] -= cap;
+    memcpy(p, &slab.free[c], sizeof(void*));
+    slab.free[c] = p;
+    slab.st.wasted += cap;
+}
 
-    int len;
-    char* buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd!=-1)
+// grow a buffer of cap bytes to at least n bytes, keeping its first cap bytes
+char* slabRealloc(int tag, char* p, int cap, int n, int* newcap)
+{
+    if (slabClass(cap) == -1 && slabClass(n) == -1)
     {
-        if(ftruncate(fd, len)!=-1)
-        {
-            if(write(fd, buf, len)==len)
-            {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+        char* new = realloc(p, n);
+        if (new == NULL)
+            die("realloc");
+        slab.st.used += n - cap;
+        memCount(tag, -cap);
+        memCount(tag, n);
+        *newcap = n;
+        return new;
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-    
+    char* new = slabAlloc(tag, n, newcap);
+    memcpy(new, p, cap < *newcap ? cap : *newcap);
+    slabFree(tag, p, cap);
+    return new;
+}
+
+// used, wasted and fragmentation of the slab for people, returns the length
+int slabSummary(char* buf, size_t len)
+{
+    char used[16], wasted[16];
+    return snprintf(buf, len, "slab used %s wasted %s frag %.1f%%",
+                    memHuman(used, sizeof(used), slab.st.used),
+                    memHuman(wasted, sizeof(wasted), slab.st.wasted),
+                    slabFragmentation() * 100);
+}
+
+// drop every arena at once, blocks from them must no longer be used
+// (buffers bigger than SLAB_MAX still have to be freed one by one)
+void slabReset()
+{
+    while (slab.arenas != NULL)
+    {
+        void* next;
+        memcpy(&next, slab.arenas, sizeof(void*));
+        free(slab.arenas);
+        slab.arenas = next;
+    }
+    // the blocks still handed out are gone with them
+    int i;
+    for (i = 0; i < MEM_TAGS; i++)
+        memCount(i, -(long long)slab.tagged[i]);
+    memset(&slab, 0, sizeof(slab));
+}
+
+/*** Row array ***/
+// E.row as a gap buffer of rows
+
+/* E.row has room for E.rowcap rows and keeps the E.rowcap - E.numrows
+unused slots as a gap at row E.rowgap, the same trick chars plays inside
+a row. Inserting or deleting n rows moves n rows plus however far the
+gap is from the last such edit, and the array only grows geometrically,
+so line operations near the cursor never shift the rest of the file.
+Rows must always be reached through ROW(). */
+
+// the row at index y
+#define ROW(y) (&E.row[(y) < E.rowgap ? (y) : (y) + E.rowcap - E.numrows])
+
+// index of a row from its address
+int editorRowIndex(erow* row)
+{
+    int at = row - E.row;
+    return at < E.rowgap ? at : at - (E.rowcap - E.numrows);
+}
+
+// move the gap of E.row to row at
+void editorRowsMoveGap(int at)
+{
+    int gaplen = E.rowcap - E.numrows;
+    if (at < E.rowgap)
+        memmove(&E.row[at + gaplen], &E.row[at], sizeof(erow) * (E.rowgap - at));
+    else if (at > E.rowgap)
+        memmove(&E.row[E.rowgap], &E.row[E.rowgap + gaplen], sizeof(erow) * (at - E.rowgap));
+    E.rowgap = at;
+}
+
+// make room for n rows at row at, their contents are left to the caller
+void editorRowsOpen(int at, int n)
+{
+    editorRowsMoveGap(at);
+    if (E.rowcap - E.numrows < n)
+    {
+        size_t cap = E.rowcap ? 2 * (size_t)E.rowcap : 64;
+        while (cap < (size_t)E.numrows + n)
+            cap *= 2;
+        if (cap > INT_MAX)
+            cap = INT_MAX;
+        if (cap < (size_t)E.numrows + n)
+        {
+            errno = EFBIG;
+            die("editorRowsOpen");
+        }
+        int tail = E.numrows - at;
+        E.row = memRealloc(MEM_ROWS, E.row, sizeof(erow) * cap);
+        memmove(&E.row[cap - tail], &E.row[E.rowcap - tail], sizeof(erow) * tail);
+        E.rowcap = cap;
+    }
+    E.rowgap += n;
+    E.numrows += n;
+}
+
+// drop rows [at, at + n) from E.row without freeing what they point to
+void editorRowsClose(int at, int n)
+{
+    editorRowsMoveGap(at);
+    E.numrows -= n;
+}
+
+/*** Line offsets ***/
+// Byte offset <-> row mapping for the status bar and Ctrl-G
+
+/* Rows are grouped in blocks of LINE_BLOCK. E.blocklen[b] is the length
+of block b, counting one newline per row, and E.linetree is a Fenwick
+tree over the block lengths: the offset of a row is a prefix sum over
+O(log n) nodes plus at most LINE_BLOCK - 1 row sizes. An edit inside a
+row changes one block and reaches the tree as a point update. Inserting
+or deleting rows shifts every later block, so then the tree is only cut
+back to the first shifted block (E.linevalid) and rebuilt lazily, as far
+as a query needs it. Offsets count the text as it would be saved, with
+'\n' line ends. */
+
+#define LINE_BLOCK 64
+
+// length of block b, one newline per row
+static long long lineBlockLen(int b)
+{
+    int y = b * LINE_BLOCK;
+    int end = y + LINE_BLOCK < E.numrows ? y + LINE_BLOCK : E.numrows;
+    long long len = 0;
+    for (; y < end; y++)
+        len += ROW(y)->size + 1;
+    return len;
+}
+
+// bring the first nblocks blocks and their tree nodes up to date
+static void lineIndexBuild(int nblocks)
+{
+    if (nblocks <= E.linevalid)
+        return;
+    if (nblocks > E.linecap)
+    {
+        E.linecap = nblocks > E.linecap * 2 ? nblocks : E.linecap * 2;
+        E.blocklen = memRealloc(MEM_ROWS, E.blocklen, sizeof(long long) * E.linecap);
+        E.linetree = memRealloc(MEM_ROWS, E.linetree, sizeof(long long) * E.linecap);
+    }
+    int b;
+    for (b = E.linevalid; b < nblocks; b++)
+    {
+        E.blocklen[b] = lineBlockLen(b);
+        // node i (stored at i - 1) adds up nodes i - 1, i - 2, i - 4, ... below its low bit
+        int i = b + 1;
+        long long sum = E.blocklen[b];
+        int step;
+        for (step = 1; step < (i & -i); step *= 2)
+            sum += E.linetree[i - step - 1];
+        E.linetree[b] = sum;
+    }
+    E.linevalid = nblocks;
+}
+
+// the size of row at changed: update its block and the tree nodes above it
+void lineIndexRowChanged(int at)
+{
+    int b = at / LINE_BLOCK;
+    if (b >= E.linevalid)
+        return;
+    long long len = lineBlockLen(b);
+    long long delta = len - E.blocklen[b];
+    E.blocklen[b] = len;
+    int i;
+    for (i = b + 1; i <= E.linevalid; i += i & -i)
+        E.linetree[i - 1] += delta;
+}
+
+// rows from at on moved, their blocks are rebuilt when next needed
+void lineIndexRowsMoved(int at)
+{
+    if (at / LINE_BLOCK < E.linevalid)
+        E.linevalid = at / LINE_BLOCK;
+}
+
+// byte offset where row y starts
+long long editorRowOffset(int y)
+{
+    int b = y / LINE_BLOCK;
+    lineIndexBuild(b);
+    long long off = 0;
+    int i;
+    for (i = b; i > 0; i -= i & -i)
+        off += E.linetree[i - 1];
+    for (i = b * LINE_BLOCK; i < y; i++)
+        off += ROW(i)->size + 1;
+    return off;
+}
+
+// row holding byte offset off and the column in *col, the end of the last row if past it
+int editorOffsetRow(long long off, int* col)
+{
+    *col = 0;
+    if (E.numrows == 0)
+        return 0;
+    int nblocks = (E.numrows + LINE_BLOCK - 1) / LINE_BLOCK;
+    lineIndexBuild(nblocks);
+
+    // walk down the tree, skipping the whole blocks that end at or before off
+    int b = 0;
+    int step = 1;
+    while (step * 2 <= nblocks)
+        step *= 2;
+    for (; step > 0; step /= 2)
+    {
+        if (b + step <= nblocks && E.linetree[b + step - 1] <= off)
+        {
+            b += step;
+            off -= E.linetree[b - 1];
+        }
+    }
+
+    int y = b * LINE_BLOCK;
+    if (y >= E.numrows)
+    {
+        *col = ROW(E.numrows - 1)->size;
+        return E.numrows - 1;
+    }
+    while (off > ROW(y)->size && y < E.numrows - 1)
+    {
+        off -= ROW(y)->size + 1;
+        y++;
+    }
+    *col = off < ROW(y)->size ? off : ROW(y)->size;
+    return y;
+}
+
+// Ctrl-G: "120" goes to line 120, "@1834920113" to that byte offset
+void editorGoto()
+{
+    char* answer = editorPrompt("Go to line, or @byte offset: %s (ESC to cancel)", NULL);
+    if (answer == NULL)
+        return;
+    int byte = answer[0] == '@';
+    char* end;
+    errno = 0;
+    long long n = strtoll(&answer[byte], &end, 10);
+    if (end == &answer[byte] || *end != '\0' || n < 0 || errno == ERANGE)
+    {
+        editorSetStatusMessage("Not a line number or @offset: %s", answer);
+        free(answer);
+        return;
+    }
+
+    if (byte)
+        E.cy = editorOffsetRow(n, &E.cx);
+    else
+    {
+        E.cy = n < 1 ? 0 : n > E.numrows ? E.numrows - 1 : n - 1;
+        if (E.cy < 0)
+            E.cy = 0;
+        E.cx = 0;
+    }
+    // show the target in the middle of the screen
+    E.rowoff = E.cy - E.screenrows / 2;
+    if (E.rowoff < 0)
+        E.rowoff = 0;
+    free(answer);
+}
+
+
+
+/*** Row Operations ***/
+// These are about the row buffer 
+
+/* chars is a gap buffer: the text is chars[0..gap) followed by
+chars[gap+(cap-size)..cap). Edits at the cursor only move the gap,
+so typing is O(1) and the buffer only grows geometrically.
+At most one row (E.gaprow) has its gap away from the end of the text.
+Rows loaded from a mapped file have cap == 0: chars points straight into
+E.map and is copied the first time the row is edited.
+Short rows keep their text inline in the erow instead of in a buffer of
+their own (ROW_INLINE, cap == ROW_INLINE_CAP). That text moves with
+E.row, so pointers from ROW_CHARS() must not be held across anything
+that inserts or deletes rows. */
+
+// length of the gap inside a row
+#define ROW_GAPLEN(row) ((row)->cap - (row)->size)
+// row text still lives in the file mapping
+#define ROW_MAPPED(row) ((row)->cap == 0)
+// where the text (and gap) of a row is stored
+#define ROW_CHARS(row) ((row)->flags & ROW_INLINE ? (row)->chars.buf : (row)->chars.ptr)
+
+// give a fresh row its own copy of len characters of s
+void editorRowSetText(erow* row, const char* s, int len)
+{
+    row->size = len;
+    row->gap = len;
+    if (len < ROW_INLINE_CAP)
+    {
+        row->flags |= ROW_INLINE;
+        row->cap = ROW_INLINE_CAP;
+    }
+    else
+    {
+        row->flags &= ~ROW_INLINE;
+        row->chars.ptr = slabAlloc(MEM_ROWS, len + 1, &row->cap);
+    }
+    memcpy(ROW_CHARS(row), s, len);
+    ROW_CHARS(row)[len] = '\0';
+}
+
+// make sure the gap can take n more characters (plus the trailing '\0')
+// editorRowReserve(row, 0) just makes a mapped row writable
+void editorRowReserve(erow* row, int n)
+{
+    if (!ROW_MAPPED(row) && ROW_GAPLEN(row) > n)
+        return;
+
+    if (ROW_MAPPED(row))
+    {
+        if (row->size + n < ROW_INLINE_CAP)
+        {
+            editorRowSetText(row, row->chars.ptr, row->size);
+            return;
+        }
+        int newcap;
+        char* copy = slabAlloc(MEM_ROWS, row->size + n + 1, &newcap);
+        memcpy(copy, row->chars.ptr, row->size);
+        row->chars.ptr = copy;
+        row->cap = newcap;
+        return;
+    }
+
+    int newcap = row->cap * 2;
+    while (newcap - row->size <= n)
+        newcap *= 2;
+
+    char* new;
+    if (row->flags & ROW_INLINE)
+    {
+        // the row outgrew its inline space
+        new = slabAlloc(MEM_ROWS, newcap, &newcap);
+        memcpy(new, row->chars.buf, row->cap);
+        row->flags &= ~ROW_INLINE;
+    }
+    else
+        new = slabRealloc(MEM_ROWS, row->chars.ptr, row->cap, newcap, &newcap);
+
+    // slide the text after the gap to the end of the bigger buffer
+    int tail = row->size - row->gap;
+    memmove(&new[newcap - tail], &new[row->cap - tail], tail);
+    row->chars.ptr = new;
+    row->cap = newcap;
+}
+
+// move the start of the gap to position at of the text
+void editorRowMoveGap(erow* row, int at)
+{
+    if (at == row->gap)
+        return;
+
+    // only one row keeps an open gap, close the previous one first
+    if (at != row->size && E.gaprow != -1 && ROW(E.gaprow) != row)
+        editorRowMoveGap(ROW(E.gaprow), ROW(E.gaprow)->size);
+
+    int gaplen = ROW_GAPLEN(row);
+    char* chars = ROW_CHARS(row);
+    if (at < row->gap)
+        memmove(&chars[at + gaplen], &chars[at], row->gap - at);
+    else
+        memmove(&chars[row->gap], &chars[row->gap + gaplen], at - row->gap);
+    row->gap = at;
+
+    if (at != row->size)
+        E.gaprow = editorRowIndex(row);
+    else if (E.gaprow != -1 && ROW(E.gaprow) == row)
+        E.gaprow = -1;
+}
+
+// close the gap and return the text of the row as one contiguous block
+// (not '\0' terminated, mapped rows point into the file)
+char* editorRowText(erow* row)
+{
+    editorRowMoveGap(row, row->size);
+    return ROW_CHARS(row);
+}
+
+// copy len characters of a row from column at into dst, leaving the gap be
+void editorRowCopy(erow* row, int at, int len, char* dst)
+{
+    char* chars = ROW_CHARS(row);
+    int before = at < row->gap ? row->gap - at : 0;
+    if (before > len)
+        before = len;
+    memcpy(dst, &chars[at], before);
+    if (len > before)
+        memcpy(dst + before, &chars[at + before + ROW_GAPLEN(row)], len - before);
+}
+
+// remember that a row no longer matches the file on disk
+void editorRowChanged(erow* row)
+{
+    int at = editorRowIndex(row);
+    E.nfound = 0; // find all results point at rows and columns
+    lineIndexRowChanged(at);
+    if (at < E.firstdirty)
+        E.firstdirty = at;
+    if (row->flags & ROW_DIRTY)
+        return;
+    row->flags |= ROW_DIRTY;
+
+    // the list of dirty rows is only useful while row indices don't shift
+    if (E.rowsmoved)
+        return;
+    if (E.ndirtyrows == E.dirtyrowscap)
+    {
+        E.dirtyrowscap = E.dirtyrowscap ? E.dirtyrowscap * 2 : 64;
+        E.dirtyrows = memRealloc(MEM_ROWS, E.dirtyrows, sizeof(int) * E.dirtyrowscap);
+    }
+    E.dirtyrows[E.ndirtyrows++] = at;
+}
+
+// rows from at on shifted, every row from there on has to be rewritten
+void editorRowsMoved(int at)
+{
+    E.nfound = 0;
+    lineIndexRowsMoved(at);
+    if (at < E.firstdirty)
+        E.firstdirty = at;
+    E.rowsmoved = 1;
+}
+
+// copy all characters into the render of a row
+void editorUpdateRow(erow *row) 
+{
+    int tabs = 0;
+    int j;
+    int gaplen = ROW_GAPLEN(row);
+    char* chars = ROW_CHARS(row);
+    for (j = 0; j < row->gap; j++)
+        if (chars[j] == '\t') tabs++;
+    for (j = row->gap + gaplen; j < row->cap; j++)
+        if (chars[j] == '\t') tabs++;
+    row->flags &= ~ROW_STALE;
+
+    // without tabs the render would be a plain copy, use the text instead
+    if (tabs == 0)
+    {
+        editorRowMoveGap(row, row->size);
+        slabFree(MEM_RENDER, row->render, row->rcap);
+        row->render = NULL;
+        row->rcap = 0;
+        row->rsize = row->size;
+        row->flags |= ROW_ALIAS;
+        return;
+    }
+    row->flags &= ~ROW_ALIAS;
+
+    // the render buffer is reused as long as it is big enough
+    int need = row->size + tabs*(KILO_TAB_STOP - 1) + 1;
+    if (need > row->rcap)
+    {
+        int newcap = row->rcap ? row->rcap : 16;
+        while (newcap < need)
+            newcap *= 2;
+        slabFree(MEM_RENDER, row->render, row->rcap);
+        row->render = slabAlloc(MEM_RENDER, newcap, &row->rcap);
+    }
+
+    int idx = 0;
+    for (j = 0; j < row->size; j++) 
+    {
+        char c = chars[j < row->gap ? j : j + gaplen];
+        if (c == '\t') 
+        {
+            row->render[idx++] = ' ';
+            while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+        } 
+        else 
+        {
+            row->render[idx++] = c;
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+/* Renders are built lazily: edits only mark a row ROW_STALE and nothing
+is rendered until a row is drawn. Rows that scroll more than RENDER_KEEP
+rows away from the screen lose their render again, so memory follows
+the viewport and not the size of the file. */
+
+#define RENDER_KEEP 256 // rows kept rendered above and below the screen
+
+// the render of a row (rsize characters), rebuilt if it is out of date
+// an aliased render is the row text and moves along with it
+char* editorRowRender(erow* row)
+{
+    if (row->flags & ROW_STALE)
+    {
+        editorUpdateRow(row);
+
+        int at = editorRowIndex(row);
+        if (E.rlo >= E.rhi)
+        {
+            E.rlo = at;
+            E.rhi = at + 1;
+        }
+        else if (at < E.rlo)
+            E.rlo = at;
+        else if (at >= E.rhi)
+            E.rhi = at + 1;
+    }
+    return row->flags & ROW_ALIAS ? ROW_CHARS(row) : row->render;
+}
+
+void editorRowDropRender(erow* row)
+{
+    slabFree(MEM_RENDER, row->render, row->rcap);
+    row->render = NULL;
+    row->rsize = 0;
+    row->rcap = 0;
+    row->flags = (row->flags & ~ROW_ALIAS) | ROW_STALE;
+}
+
+// free every render outside rows [lo, hi)
+void editorEvictRenders(int lo, int hi)
+{
+    int j;
+    for (j = E.rlo; j < E.rhi && j < lo; j++)
+        editorRowDropRender(ROW(j));
+    for (j = hi > E.rlo ? hi : E.rlo; j < E.rhi; j++)
+        editorRowDropRender(ROW(j));
+
+    if (E.rlo < lo)
+        E.rlo = lo;
+    if (E.rhi > hi)
+        E.rhi = hi;
+    if (E.rlo >= E.rhi)
+        E.rlo = E.rhi = 0;
+}
+
+// keep [rlo, rhi) covering the rendered rows when rows from at on move by delta
+// (a negative delta means rows [at, at - delta) were deleted)
+void editorRenderShift(int at, int delta)
+{
+    if (E.rlo >= E.rhi)
+        return;
+    if (delta < 0)
+    {
+        int end = at - delta;
+        if (E.rlo > at)
+            E.rlo = E.rlo < end ? at : E.rlo + delta;
+        if (E.rhi > at)
+            E.rhi = E.rhi < end ? at : E.rhi + delta;
+    }
+    else
+    {
+        if (at <= E.rlo)
+            E.rlo += delta;
+        if (at < E.rhi)
+            E.rhi += delta;
+    }
+    if (E.rlo >= E.rhi)
+        E.rlo = E.rhi = 0;
+}
+
+// making changes in a certain row in the buffer
+void editorRowInsertChar(erow* row, int at, int c)
+{
+    if(at < 0 || at > row->size)
+        at = row->size;
+
+    char ch = c;
+    undoInsert(editorRowIndex(row), at, &ch, 1, 1);
+    journalAdd(UNDO_INSERT, editorRowIndex(row), at, 1, &ch);
+
+    // open the gap at the insertion point and drop the character into it
+    editorRowReserve(row, 1);
+    editorRowMoveGap(row, at);
+    ROW_CHARS(row)[row->gap++] = c;
+    row->size++;
+    row->flags |= ROW_STALE;
+    editorRowChanged(row);
+    E.dirty++;
+}
+
+int editorRowCxToRx(erow* row, int cx)
+{
+    int rx = 0;
+    int j;
+    int gaplen = ROW_GAPLEN(row);
+    char* chars = ROW_CHARS(row);
+    for(j=0;j<cx;j++)
+    {
+        if(chars[j < row->gap ? j : j + gaplen]=='\t')
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+        rx++;
+    }
+    return rx;
+}
+
+// insert len characters at position at of the row
+void editorRowInsertString(erow* row, int at, const char* s, size_t len)
+{
+    if(at < 0 || at > row->size)
+        at = row->size;
+
+    undoInsert(editorRowIndex(row), at, s, len, 0);
+    journalAdd(UNDO_INSERT, editorRowIndex(row), at, len, s);
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, at);
+    memcpy(&ROW_CHARS(row)[row->gap], s, len);
+    row->gap += len;
+    row->size += len;
+    row->flags |= ROW_STALE;
+    editorRowChanged(row);
+    E.dirty++;
+}
+
+// insert n empty rows at row at
+void editorInsertRows(int at, int n)
+{
+    if (at < 0 || at > E.numrows || n <= 0) return;
+    undoInsertRows(at, n);
+    journalAdd(UNDO_INSROWS, at, 0, n, NULL);
+    editorRowsOpen(at, n);
+    if (E.gaprow >= at)
+        E.gaprow += n;
+
+    int i;
+    for (i = at; i < at + n; i++)
+    {
+        erow* row = ROW(i);
+        row->rsize = 0;
+        row->rcap = 0;
+        row->render = NULL;
+        row->flags = ROW_DIRTY | ROW_STALE;
+        row->off = 0;
+        editorRowSetText(row, "", 0);
+    }
+    editorRowsMoved(at);
+    editorRenderShift(at, n);
+    E.dirty++;
+}
+
+// initialising each row in the editor
+void editorInsertRow(int at, char *s, size_t len) 
+{
+    if (at < 0 || at > E.numrows) return;
+    editorInsertRows(at, 1);
+    editorRowSetText(ROW(at), s, len);
+    journalAdd(UNDO_INSERT, at, 0, len, s);
+}
+
+void editorFreeRow(erow* row)
+{
+    slabFree(MEM_RENDER, row->render, row->rcap);
+    if (!ROW_MAPPED(row) && !(row->flags & ROW_INLINE))
+        slabFree(MEM_ROWS, row->chars.ptr, row->cap);
+}
+
+// delete rows [at, at + n)
+void editorDelRows(int at, int n)
+{
+    if (at < 0 || at >= E.numrows || n <= 0)
+        return;
+    if (n > E.numrows - at)
+        n = E.numrows - at;
+    if (E.gaprow >= at + n)
+        E.gaprow -= n;
+    else if (E.gaprow >= at)
+        E.gaprow = -1;
+    undoDeleteRows(at, n);
+    journalAdd(UNDO_DELROWS, at, 0, n, NULL);
+    int i;
+    for (i = at; i < at + n; i++)
+        editorFreeRow(ROW(i));
+    editorRowsClose(at, n);
+    editorRowsMoved(at);
+    editorRenderShift(at, -n);
+    E.dirty++;
+}
+
+void editorDelRow(int at)
+{
+    editorDelRows(at, 1);
+}
+
+// move rows [from, from + n) so that they start at row to of the result
+void editorMoveRows(int from, int n, int to)
+{
+    if (from < 0 || n <= 0 || from + n > E.numrows || to < 0 || to > E.numrows - n || to == from)
+        return;
+    undoMoveRows(from, n, to);
+    journalAdd(UNDO_MOVE, from, to, n, NULL);
+    // gaprow is an index, settle it before the rows shuffle
+    if (E.gaprow != -1)
+        editorRowMoveGap(ROW(E.gaprow), ROW(E.gaprow)->size);
+
+    erow* block = memAlloc(MEM_ROWS, sizeof(erow) * n);
+    int i;
+    for (i = 0; i < n; i++)
+        block[i] = *ROW(from + i);
+    editorRowsClose(from, n);
+    editorRowsOpen(to, n);
+    for (i = 0; i < n; i++)
+        *ROW(to + i) = block[i];
+    memFree(block);
+
+    // the rows in between only swap places, renders stay with their rows
+    int lo = from < to ? from : to;
+    int hi = (from < to ? to : from) + n;
+    if (E.rlo < E.rhi && E.rlo < hi && lo < E.rhi)
+    {
+        if (lo < E.rlo)
+            E.rlo = lo;
+        if (hi > E.rhi)
+            E.rhi = hi;
+    }
+    editorRowsMoved(lo);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow* row,int at)
+{
+    if(at < 0 || at >=row->size)
+        return ;
+    undoDelete(row, at, 1, 1);
+    journalAdd(UNDO_DELETE, editorRowIndex(row), at, 1, NULL);
+    // put the gap right after the character and let the gap swallow it
+    editorRowReserve(row, 0);
+    editorRowMoveGap(row, at + 1);
+    row->gap--;
+    row->size--;
+    row->flags |= ROW_STALE;
+    editorRowChanged(row);
+    E.dirty++;
+}
+
+// delete len characters from position at of the row
+void editorRowDelString(erow* row, int at, int len)
+{
+    if (at < 0 || len <= 0 || len > row->size - at)
+        return;
+    undoDelete(row, at, len, 0);
+    journalAdd(UNDO_DELETE, editorRowIndex(row), at, len, NULL);
+    editorRowReserve(row, 0);
+    editorRowMoveGap(row, at + len);
+    row->gap -= len;
+    row->size -= len;
+    row->flags |= ROW_STALE;
+    editorRowChanged(row);
+    E.dirty++;
+}
+
+void editorRowAppendString(erow* row, char* s, size_t len)
+{
+    undoInsert(editorRowIndex(row), row->size, s, len, 0);
+    journalAdd(UNDO_INSERT, editorRowIndex(row), row->size, len, s);
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, row->size);
+    memcpy(&ROW_CHARS(row)[row->size], s, len);
+    row->size += len;
+    row->gap = row->size;
+    ROW_CHARS(row)[row->size] = '\0';
+    row->flags |= ROW_STALE;
+    editorRowChanged(row);
+    E.dirty++;
+}
+
+// cut the row down to its first at characters
+void editorRowTruncate(erow* row, int at)
+{
+    undoDelete(row, at, row->size - at, 0);
+    journalAdd(UNDO_DELETE, editorRowIndex(row), at, row->size - at, NULL);
+    editorRowReserve(row, 0);
+    editorRowMoveGap(row, at);
+    row->size = at;
+    ROW_CHARS(row)[row->size] = '\0';
+    if (E.gaprow != -1 && ROW(E.gaprow) == row)
+        E.gaprow = -1;
+    row->flags |= ROW_STALE;
+    editorRowChanged(row);
+}
+
+// give a row new text without copying the old text first
+void editorRowReplaceText(erow* row, const char* s, int len)
+{
+    undoDelete(row, 0, row->size, 0);
+    undoInsert(editorRowIndex(row), 0, s, len, 0);
+    journalAdd(UNDO_DELETE, editorRowIndex(row), 0, row->size, NULL);
+    journalAdd(UNDO_INSERT, editorRowIndex(row), 0, len, s);
+    if (!ROW_MAPPED(row) && !(row->flags & ROW_INLINE))
+        slabFree(MEM_ROWS, row->chars.ptr, row->cap);
+    if (E.gaprow != -1 && ROW(E.gaprow) == row)
+        E.gaprow = -1;
+    editorRowSetText(row, s, len);
+    row->flags |= ROW_STALE;
+    editorRowChanged(row);
+}
+
+
+
+
+/*** Line index ***/
+// Splitting a mapped file into rows, in parallel on big files
+
+/* The file is cut into one chunk per core. A first pass counts the
+newlines of every chunk, the counts are summed into the first row index
+of each chunk, and a second pass lets every chunk fill its own slice of
+E.row. Both passes use the widest newline scanner the CPU supports. */
+
+#define INDEX_MIN_CHUNK (1 << 20) // don't bother with threads below 1MB per chunk
+#define INDEX_MAX_THREADS 64
+
+// count the newlines in [p, end)
+static size_t countNewlinesScalar(const char* p, const char* end)
+{
+    size_t n = 0;
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+// find the first newline in [p, end), or end if there is none
+static const char* findNewlineScalar(const char* p, const char* end)
+{
+    const char* nl = memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+#if defined(__SSE2__)
+static size_t countNewlinesSSE2(const char* p, const char* end)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t n = 0;
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+    return n + countNewlinesScalar(p, end);
+}
+
+static const char* findNewlineSSE2(const char* p, const char* end)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return findNewlineScalar(p, end);
+}
+#endif
+
+#if defined(INDEX_AVX2)
+__attribute__((target("avx2")))
+static size_t countNewlinesAVX2(const char* p, const char* end)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0;
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+    }
+    return n + countNewlinesScalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* findNewlineAVX2(const char* p, const char* end)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return findNewlineScalar(p, end);
+}
+#endif
+
+static size_t (*countNewlines)(const char*, const char*) = countNewlinesScalar;
+static const char* (*findNewline)(const char*, const char*) = findNewlineScalar;
+
+// pick the newline scanners for this CPU
+void editorInitLineIndex()
+{
+#if defined(__SSE2__)
+    countNewlines = countNewlinesSSE2;
+    findNewline = findNewlineSSE2;
+#endif
+#if defined(INDEX_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        countNewlines = countNewlinesAVX2;
+        findNewline = findNewlineAVX2;
+    }
+#endif
+}
+
+struct indexChunk
+{
+    const char* start;
+    const char* end;
+    size_t newlines; // newlines inside [start, end)
+    const char* last; // last newline of the chunk, NULL if none
+    const char* linestart; // where the first row ending in this chunk starts
+    size_t firstrow; // index in E.row of the first row ending in this chunk
+    int crlf; // some row lost a '\r' before its newline
+} typedef indexChunk;
+
+// point a row into the mapping, dropping the '\r's of CRLF line endings
+// returns 1 if any '\r' was dropped
+static int editorIndexRow(erow* row, const char* p, const char* eol)
+{
+    const char* full = eol;
+    while (eol > p && eol[-1] == '\r')
+        eol--;
+    row->size = eol - p;
+    row->gap = row->size;
+    row->cap = 0;
+    row->chars.ptr = (char*)p;
+    row->rsize = 0;
+    row->rcap = 0;
+    row->render = NULL;
+    row->flags = ROW_STALE;
+    row->off = p - E.map;
+    return eol != full;
+}
+
+static void* editorIndexCount(void* arg)
+{
+    indexChunk* c = arg;
+    c->newlines = countNewlines(c->start, c->end);
+    // the last newline of the chunk, scanning back (memrchr is not portable)
+    c->last = NULL;
+    if (c->newlines)
+    {
+        const char* p = c->end;
+        while (*--p != '\n')
+            ;
+        c->last = p;
+    }
+    return NULL;
+}
+
+static void* editorIndexFill(void* arg)
+{
+    indexChunk* c = arg;
+    const char* p = c->linestart;
+    const char* scan = c->start;
+    erow* row = &E.row[c->firstrow]; // past the gap, see editorOpenMapped
+    size_t i;
+    c->crlf = 0;
+    for (i = 0; i < c->newlines; i++)
+    {
+        const char* nl = findNewline(scan, c->end);
+        c->crlf |= editorIndexRow(row++, p, nl);
+        p = scan = nl + 1;
+    }
+    return NULL;
+}
+
+// run fn over every chunk, one thread per chunk, the caller taking the first
+static void editorIndexRun(void* (*fn)(void*), indexChunk* chunks, int n)
+{
+    pthread_t tid[INDEX_MAX_THREADS];
+    int started[INDEX_MAX_THREADS];
+    int i;
+    for (i = 1; i < n; i++)
+        started[i] = pthread_create(&tid[i], NULL, fn, &chunks[i]) == 0;
+    fn(&chunks[0]);
+    for (i = 1; i < n; i++)
+    {
+        if (started[i])
+            pthread_join(tid[i], NULL);
+        else
+            fn(&chunks[i]);
+    }
+}
+
+/* Index the lines of a mapped file: each row points into the mapping and
+nothing is copied or rendered until the row is edited or drawn.
+Returns the number of threads used; *exact is set when every line ends
+in a plain '\n', so that rows and file bytes match one to one. */
+int editorOpenMapped(char* map, size_t len, int* exact)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = len / INDEX_MIN_CHUNK;
+    if (n > ncpu)
+        n = ncpu;
+    if (n > INDEX_MAX_THREADS)
+        n = INDEX_MAX_THREADS;
+    if (n < 1)
+        n = 1;
+
+    indexChunk chunks[INDEX_MAX_THREADS];
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        chunks[i].start = map + len / n * i;
+        chunks[i].end = i == n - 1 ? map + len : map + len / n * (i + 1);
+    }
+    editorIndexRun(editorIndexCount, chunks, n);
+
+    // stitch the chunks: where each one starts in E.row and in the text
+    size_t total = 0;
+    const char* linestart = map;
+    for (i = 0; i < n; i++)
+    {
+        chunks[i].linestart = linestart;
+        chunks[i].firstrow = E.numrows + total;
+        total += chunks[i].newlines;
+        if (chunks[i].last)
+            linestart = chunks[i].last + 1;
+    }
+    // a last line without a trailing newline is a row too
+    int partial = linestart < map + len;
+    if (total + partial > INT_MAX - (size_t)E.numrows)
+    {
+        errno = EFBIG;
+        die("editorOpen");
+    }
+
+    // the new rows fill the gap, moved to the end and cut to size
+    editorRowsMoveGap(E.numrows);
+    E.rowcap = E.numrows + total + partial;
+    E.row = memRealloc(MEM_ROWS, E.row, sizeof(erow) * E.rowcap);
+    editorIndexRun(editorIndexFill, chunks, n);
+
+    *exact = !partial;
+    for (i = 0; i < n; i++)
+        if (chunks[i].crlf)
+            *exact = 0;
+    if (partial)
+        editorIndexRow(&E.row[E.numrows + total], linestart, map + len);
+    E.numrows += total + partial;
+    return n;
+}
+
+/*** file I/O ***/
+
+// drop all rows of the current buffer, the slab arenas go back in one piece
+void editorCloseBuffer()
+{
+    int j;
+    for (j = 0; j < E.numrows; j++)
+    {
+        erow* row = ROW(j);
+        if (row->rcap > SLAB_MAX)
+            slabFree(MEM_RENDER, row->render, row->rcap);
+        if (!ROW_MAPPED(row) && !(row->flags & ROW_INLINE) && row->cap > SLAB_MAX)
+            slabFree(MEM_ROWS, row->chars.ptr, row->cap);
+    }
+    slabReset();
+
+    memFree(E.row);
+    E.row = NULL;
+    E.numrows = 0;
+    E.rowgap = E.rowcap = 0;
+    E.gaprow = -1;
+    E.rlo = E.rhi = 0;
+    E.nfound = 0;
+    E.linevalid = 0;
+    if (E.map != NULL)
+        munmap(E.map, E.maplen);
+    E.map = NULL;
+    E.maplen = 0;
+    E.cx = E.cy = 0;
+    E.rowoff = E.coloff = 0;
+}
+
+void editorOpen(char* filename)
+{
+    editorCloseBuffer();
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    struct timespec t0, t1;
+    int threads = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // map regular files and only build the line index up front
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    char* map = MAP_FAILED;
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd != -1)
+        close(fd);
+
+    if (map != MAP_FAILED)
+    {
+        E.map = map;
+        E.maplen = st.st_size;
+        E.mapsame = 1;
+        threads = editorOpenMapped(map, st.st_size, &E.diskexact);
+        E.disksize = st.st_size;
+        E.diskdev = st.st_dev;
+        E.diskino = st.st_ino;
+        E.diskmtime = STAT_MTIM(st);
+    }
+    else
+    {
+        // reading input from a file
+        FILE *fp = fopen(filename, "r");
+        if(!(fp))
+            die("fopen"); // error message
+
+        char* line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+
+        E.undoing = 1; // no undo records for every line read
+        while ((linelen = getline(&line, &linecap, fp)) != -1)
+        {
+            while(linelen > 0 && (line[linelen-1]=='\n' || line[linelen-1]=='\r'))
+                linelen--;
+            editorInsertRow(E.numrows, line, linelen);
+        }
+        E.undoing = 0;
+        free(line);
+        fclose(fp);
+        // the first save rewrites the whole file
+        E.diskexact = 0;
+    }
+    E.dirty = 0;
+    E.firstdirty = INT_MAX;
+    E.rowsmoved = 0;
+    E.ndirtyrows = 0;
+    undoClear(); // loading is not an edit
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    editorSetStatusMessage("Loaded %d lines in %.1f ms (%d thread%s)",
+                           E.numrows, ms, threads, threads > 1 ? "s" : "");
+    if (!E.headless)
+        journalOpen(1);
+}
+
+#define SAVE_IOV 1024 // iovecs handed to one writev()
+#define SAVE_INPLACE_MIN (4 << 20) // smaller files are always saved through a temp file
+
+// write all the iovecs, carrying on after short writes
+static int writevAll(int fd, struct iovec* iov, int cnt)
+{
+    while (cnt > 0)
+    {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Stream the rows from row from on, with their newlines, straight from
+E.row into fd, whose file offset is base. Rows are gathered SAVE_IOV
+iovecs at a time; the text on both sides of a row's gap goes out as two
+iovecs, so nothing is copied. The rows written get their new file
+offsets and are no longer dirty. */
+long long editorWriteRows(int fd, int from, long long base)
+{
+    static char newline = '\n';
+    struct iovec iov[SAVE_IOV];
+    int cnt = 0;
+    long long total = 0;
+    int j;
+    for (j = from; j < E.numrows; j++)
+    {
+        erow* row = ROW(j);
+        if (cnt > SAVE_IOV - 3)
+        {
+            if (writevAll(fd, iov, cnt) == -1)
+                return -1;
+            cnt = 0;
+        }
+        if (row->gap > 0)
+        {
+            iov[cnt].iov_base = ROW_CHARS(row);
+            iov[cnt++].iov_len = row->gap;
+        }
+        if (row->size > row->gap)
+        {
+            iov[cnt].iov_base = &ROW_CHARS(row)[row->gap + ROW_GAPLEN(row)];
+            iov[cnt++].iov_len = row->size - row->gap;
+        }
+        iov[cnt].iov_base = &newline;
+        iov[cnt++].iov_len = 1;
+        row->off = base + total;
+        row->flags &= ~ROW_DIRTY;
+        total += row->size + 1;
+    }
+    if (cnt > 0 && writevAll(fd, iov, cnt) == -1)
+        return -1;
+    return total;
+}
+
+/* Save through a temporary file in the same directory: write it, fsync
+it and rename it over the file, so a crash or a full disk part way
+leaves the old file intact. Returns the bytes written or -1. */
+long long editorSaveAtomic(const char* filename)
+{
+    // write through symlinks instead of replacing them
+    char* path = realpath(filename, NULL);
+    if (path == NULL)
+        path = strdup(filename);
+
+    char* tmp = memAlloc(MEM_FILE, strlen(path) + 16);
+    char* slash = strrchr(path, '/');
+    if (slash)
+        sprintf(tmp, "%.*s.%s.XXXXXX", (int)(slash - path + 1), path, slash + 1);
+    else
+        sprintf(tmp, ".%s.XXXXXX", path);
+
+    long long written = -1;
+    int fd = mkstemp(tmp);
+    if (fd != -1)
+    {
+        // keep the permissions of the file being replaced
+        struct stat st;
+        mode_t mode;
+        if (stat(path, &st) == 0)
+            mode = st.st_mode & 07777;
+        else
+        {
+            mode_t mask = umask(0);
+            umask(mask);
+            mode = 0644 & ~mask;
+        }
+
+        if (fchmod(fd, mode) != -1 &&
+            (written = editorWriteRows(fd, 0, 0)) != -1 &&
+            fsync(fd) != -1)
+        {
+            if (fstat(fd, &st) == 0)
+            {
+                E.diskdev = st.st_dev;
+                E.diskino = st.st_ino;
+                E.diskmtime = STAT_MTIM(st);
+            }
+            if (close(fd) == -1 || rename(tmp, path) == -1)
+                written = -1;
+        }
+        else
+        {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            written = -1;
+        }
+
+        if (written == -1)
+        {
+            int saved = errno;
+            unlink(tmp);
+            errno = saved;
+        }
+        else
+        {
+            // make the rename itself durable
+            const char* dir = ".";
+            if (slash)
+            {
+                *slash = '\0';
+                dir = path[0] ? path : "/";
+            }
+            int dirfd = open(dir, O_RDONLY);
+            if (dirfd != -1)
+            {
+                fsync(dirfd);
+                close(dirfd);
+            }
+        }
+    }
+    memFree(tmp);
+    free(path);
+    return written;
+}
+
+/* Rewrite only what changed, in place. When no row was inserted or
+deleted and no dirty row changed length, just the dirty rows are
+written back; otherwise everything from the first changed row to the
+end is rewritten and the file truncated to its new size. Returns the
+bytes written, -1 on error, or -2 when this save has to go through
+editorSaveAtomic instead: small files (which are cheap to save safely),
+files we don't know the exact layout of, files changed behind our back,
+and rewrites that would overwrite parts of the mapping still in use. */
+long long editorSaveInPlace(const char* filename)
+{
+    if (!E.diskexact || E.disksize < SAVE_INPLACE_MIN)
+        return -2;
+    struct stat st;
+    if (stat(filename, &st) == -1 || st.st_dev != E.diskdev ||
+        st.st_ino != E.diskino || st.st_size != E.disksize ||
+        STAT_MTIM(st).tv_sec != E.diskmtime.tv_sec || STAT_MTIM(st).tv_nsec != E.diskmtime.tv_nsec)
+        return -2;
+
+    int j;
+    int samelen = !E.rowsmoved;
+    for (j = 0; samelen && j < E.ndirtyrows; j++)
+    {
+        int at = E.dirtyrows[j];
+        long long end = at + 1 < E.numrows ? ROW(at + 1)->off : E.disksize;
+        if (end - ROW(at)->off - 1 != ROW(at)->size)
+            samelen = 0;
+    }
+
+    int from = E.firstdirty < E.numrows ? E.firstdirty : E.numrows;
+    long long start = from > 0 ? ROW(from - 1)->off + ROW(from - 1)->size + 1 : 0;
+    if (!samelen && E.mapsame)
+    {
+        // mapped rows are read from the very file being rewritten:
+        // only safe if none of them moves
+        long long off = start;
+        for (j = from; j < E.numrows; j++)
+        {
+            if (ROW_MAPPED(ROW(j)) && ROW(j)->chars.ptr - E.map != off)
+                return -2;
+            off += ROW(j)->size + 1;
+        }
+    }
+
+    int fd = open(filename, O_WRONLY);
+    if (fd == -1)
+        return -1;
+
+    long long written = 0;
+    if (samelen)
+    {
+        for (j = 0; j < E.ndirtyrows && written != -1; j++)
+        {
+            erow* row = ROW(E.dirtyrows[j]);
+            if (!(row->flags & ROW_DIRTY))
+                continue;
+            if (pwrite(fd, editorRowText(row), row->size, row->off) != row->size)
+                written = -1;
+            else
+            {
+                row->flags &= ~ROW_DIRTY;
+                written += row->size;
+            }
+        }
+    }
+    else
+    {
+        written = -1;
+        if (lseek(fd, start, SEEK_SET) != -1)
+            written = editorWriteRows(fd, from, start);
+        if (written != -1)
+        {
+            E.disksize = start + written;
+            if (ftruncate(fd, E.disksize) == -1)
+                written = -1;
+        }
+    }
+
+    if (written != -1 && fsync(fd) == -1)
+        written = -1;
+    if (written != -1 && fstat(fd, &st) == 0)
+        E.diskmtime = STAT_MTIM(st);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return written;
+}
+
+// to save contents into the file
+// returns 0 once the buffer is on disk, -1 if it is not
+int editorSave()
+{
+    if(E.filename == NULL)
+    {
+        E.filename = editorPrompt("Save as : %s", NULL);
+        if (E.filename == NULL) 
+        {
+            editorSetStatusMessage("Save aborted");
+            return -1;
+        }
+    }
+
+    long long t0 = editorNowMs();
+    long long len = editorSaveInPlace(E.filename);
+    if (len == -2)
+    {
+        len = editorSaveAtomic(E.filename);
+        if (len != -1)
+        {
+            E.diskexact = 1;
+            E.disksize = len;
+            E.mapsame = 0;
+        }
+    }
+    if (len == -1)
+    {
+        // the layout on disk is unknown now, the next save rewrites it all
+        E.diskexact = 0;
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return -1;
+    }
+
+    double secs = (editorNowMs() - t0) / 1000.0;
+    if (!E.headless)
+        journalOpen(0); // the file has it all now
+    E.dirty = 0;
+    E.firstdirty = INT_MAX;
+    E.rowsmoved = 0;
+    E.ndirtyrows = 0;
+    if (secs > 0)
+        editorSetStatusMessage("%lld bytes written to disk (%.1f MB/s)", len, len / 1e6 / secs);
+    else
+        editorSetStatusMessage("%lld bytes written to disk", len);
+    return 0;
+}
+
+
+/*** Journal ***/
+// Unsaved edits kept in FILE.swp so a crash loses at most a second of work
+
+/* Every change to the buffer is appended to the journal as a record of
+its row operation (the UNDO_ codes): insertions carry their text,
+deletions only say where. A replace all is a single record of its two
+strings, so even a replace over the whole file stays small. Records are
+collected in jnl.buf and written, at most JOURNAL_WRITE bytes per call,
+by a timer JOURNAL_SYNC ms after the first unwritten change, which also
+syncs them to disk. The journal starts with the size and mtime of the
+file the records apply to. When editorOpen finds a journal for the file
+as it is on disk, it replays the records through the row operations,
+which costs the edits and not the size of the file. Saving starts the
+journal over and quitting removes it. An editor holds a flock on its
+journal for as long as it runs, so a second editor on the same file
+neither replays nor writes it. */
+
+#define JOURNAL_SYNC 1000
+#define JOURNAL_WRITE (64 * 1024)
+#define JOURNAL_HEAD 13 // op byte then y, x and n as ints
+#define JOURNAL_REPLACE 5 // every x bytes of text replaced by the n bytes after them
+
+struct journalHeader {
+    char magic[8];
+    long long size; // of the file the records apply to
+    long long sec, nsec; // its mtime
+} typedef journalHeader;
+
+struct journal {
+    int fd; // the locked journal, -1 when there is none
+    int failed; // a write failed, the rest of the edits are not journaled
+    char* path; // set while fd is
+    char* buf; // records not written yet
+    size_t len, cap;
+    int timer; // the pending sync, -1 if none
+    int off; // > 0 while an operation journals itself as a whole
+} typedef journal;
+
+static journal jnl = {-1, 0, NULL, NULL, 0, 0, -1, 0};
+
+// give up on the journal, the edits are still in the buffer
+// (the journal stays open and locked until journalClose)
+static void journalFail(const char* what)
+{
+    editorSetStatusMessage("Journal off, %s %s: %s", what, jnl.path, strerror(errno));
+    jnl.failed = 1;
+    jnl.len = 0;
+}
+
+// write out the records collected so far
+static void journalWrite()
+{
+    size_t done = 0;
+    while (jnl.fd != -1 && !jnl.failed && done < jnl.len)
+    {
+        size_t n = jnl.len - done < JOURNAL_WRITE ? jnl.len - done : JOURNAL_WRITE;
+        ssize_t w = write(jnl.fd, &jnl.buf[done], n);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w == -1)
+            journalFail("can't write");
+        else
+            done += w;
+    }
+    jnl.len = 0;
+}
+
+// timer: make the records durable
+static void journalSync()
+{
+    editorRemoveTimer(jnl.timer);
+    jnl.timer = -1;
+    journalWrite();
+    if (jnl.fd != -1 && !jnl.failed && fdatasync(jnl.fd) == -1)
+        journalFail("can't sync");
+}
+
+// room for n more bytes in jnl.buf
+static char* journalReserve(size_t n)
+{
+    if (jnl.len + n > jnl.cap)
+    {
+        jnl.cap = jnl.cap * 2 > jnl.len + n ? jnl.cap * 2 : jnl.len + n;
+        jnl.buf = memRealloc(MEM_FILE, jnl.buf, jnl.cap);
+    }
+    char* p = &jnl.buf[jnl.len];
+    jnl.len += n;
+    return p;
+}
+
+static void journalPut(int op, int y, int x, int n, const char* a, size_t alen, const char* b, size_t blen)
+{
+    char* p = journalReserve(JOURNAL_HEAD + alen + blen);
+    *p = op;
+    memcpy(p + 1, &y, sizeof(int));
+    memcpy(p + 5, &x, sizeof(int));
+    memcpy(p + 9, &n, sizeof(int));
+    if (alen > 0)
+        memcpy(p + JOURNAL_HEAD, a, alen);
+    if (blen > 0)
+        memcpy(p + JOURNAL_HEAD + alen, b, blen);
+    if (jnl.len >= JOURNAL_WRITE)
+        journalWrite();
+    if (jnl.fd != -1 && !jnl.failed && jnl.timer == -1)
+        jnl.timer = editorAddTimer(JOURNAL_SYNC, journalSync);
+}
+
+// a row operation changed the buffer, UNDO_INSERT carries the n characters of text
+void journalAdd(int op, int y, int x, int n, const char* text)
+{
+    if (jnl.fd == -1 || jnl.failed || jnl.off || (n == 0 && op <= UNDO_DELETE))
+        return;
+    journalPut(op, y, x, n, text, op == UNDO_INSERT ? n : 0, NULL, 0);
+}
+
+// every old is about to be replaced by new
+static void journalReplace(const char* old, int oldlen, const char* new, int newlen)
+{
+    if (jnl.fd == -1 || jnl.failed || jnl.off)
+        return;
+    journalPut(JOURNAL_REPLACE, 0, oldlen, newlen, old, oldlen, new, newlen);
+}
+
+// apply one record, 0 if it does not fit the buffer
+static int journalApply(int op, int y, int x, int n, const char* text)
+{
+    if (op == JOURNAL_REPLACE)
+    {
+        if (x <= 0 || n < 0)
+            return 0;
+        editorReplaceAll(text, x, text + x, n);
+        return 1;
+    }
+    if (y < 0 || x < 0 || n < 0 || y > E.numrows)
+        return 0;
+    int rows = y < E.numrows;
+    switch (op)
+    {
+        case UNDO_INSERT:
+            if (!rows || x > ROW(y)->size)
+                return 0;
+            editorRowInsertString(ROW(y), x, text, n);
+            x += n;
+            break;
+        case UNDO_DELETE:
+            if (!rows || n > ROW(y)->size - x)
+                return 0;
+            editorRowDelString(ROW(y), x, n);
+            break;
+        case UNDO_INSROWS:
+            editorInsertRows(y, n);
+            x = 0;
+            break;
+        case UNDO_DELROWS:
+            if (n > E.numrows - y)
+                return 0;
+            editorDelRows(y, n);
+            x = 0;
+            break;
+        case UNDO_MOVE:
+            if (n > E.numrows - y || x > E.numrows - n)
+                return 0;
+            editorMoveRows(y, n, x);
+            y = x;
+            x = 0;
+            break;
+        default:
+            return 0;
+    }
+    // the cursor ends up at the last change
+    E.cy = y;
+    E.cx = x;
+    return 1;
+}
+
+// replay the records in [p, end), returns the bytes of those applied
+static size_t journalReplay(const char* p, const char* end, int* count)
+{
+    const char* start = p;
+    while (end - p >= JOURNAL_HEAD)
+    {
+        int op = *p, y, x, n;
+        memcpy(&y, p + 1, sizeof(int));
+        memcpy(&x, p + 5, sizeof(int));
+        memcpy(&n, p + 9, sizeof(int));
+        const char* text = p + JOURNAL_HEAD;
+        long long len = op == UNDO_INSERT ? n : op == JOURNAL_REPLACE ? (long long)x + n : 0;
+        if (len < 0 || len > end - text || !journalApply(op, y, x, n, text))
+            break;
+        p = text + len;
+        (*count)++;
+    }
+    return p - start;
+}
+
+// stop journaling, removing the journal if drop
+void journalClose(int drop)
+{
+    if (jnl.timer != -1)
+        editorRemoveTimer(jnl.timer);
+    jnl.timer = -1;
+    // unlink while still holding the lock, the journal may be half written
+    if (drop && jnl.path != NULL)
+        unlink(jnl.path);
+    if (jnl.fd != -1)
+        close(jnl.fd);
+    jnl.fd = -1;
+    jnl.failed = 0;
+    jnl.len = 0;
+    memFree(jnl.path);
+    jnl.path = NULL;
+}
+
+// open and lock the journal at path, -1 if that fails or another editor has it
+static int journalLock(const char* path)
+{
+    int tries;
+    for (tries = 0; tries < 3; tries++)
+    {
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+        {
+            editorSetStatusMessage("No journal, can't open %s: %s", path, strerror(errno));
+            return -1;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+        {
+            if (errno == EWOULDBLOCK)
+                editorSetStatusMessage("No journal, %s is in use by another editor", path);
+            else
+                editorSetStatusMessage("No journal, can't lock %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        // the editor that held it may have removed it before letting go
+        struct stat held, named;
+        if (fstat(fd, &held) == 0 && stat(path, &named) == 0 &&
+            held.st_dev == named.st_dev && held.st_ino == named.st_ino)
+            return fd;
+        close(fd);
+    }
+    editorSetStatusMessage("No journal, %s keeps changing", path);
+    return -1;
+}
+
+/* Journal the edits to E.filename from now on. With replay, the edits in
+an existing journal for the file as it is on disk are applied first;
+otherwise the journal starts out empty. After a save (no replay) the
+journal of the file is started over without letting go of its lock,
+and one left for another name is removed. */
+void journalOpen(int replay)
+{
+    char* path = NULL;
+    if (E.filename != NULL)
+    {
+        size_t n = strlen(E.filename);
+        path = memAlloc(MEM_FILE, n + 5);
+        memcpy(path, E.filename, n);
+        memcpy(path + n, ".swp", 5);
+    }
+    int fd = -1;
+    if (path != NULL && jnl.fd != -1 && strcmp(path, jnl.path) == 0)
+    {
+        fd = jnl.fd;
+        jnl.fd = -1;
+        memFree(jnl.path);
+        jnl.path = NULL;
+    }
+    journalClose(!replay);
+    if (path == NULL)
+        return;
+    if (fd == -1 && (fd = journalLock(path)) == -1)
+    {
+        memFree(path);
+        return;
+    }
+    jnl.path = path;
+
+    struct stat st;
+    journalHeader head, disk;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, "KILOJNL1", 8);
+    if (stat(E.filename, &st) == 0)
+    {
+        head.size = st.st_size;
+        head.sec = STAT_MTIM(st).tv_sec;
+        head.nsec = STAT_MTIM(st).tv_nsec;
+    }
+
+    long long keep = 0;
+    if (fstat(fd, &st) == -1)
+        keep = -1;
+    else if (replay && st.st_size > (off_t)sizeof(head))
+    {
+        if (pread(fd, &disk, sizeof(disk), 0) != sizeof(disk) || memcmp(&disk, &head, sizeof(head)) != 0)
+            editorSetStatusMessage("Dropped %s, it is for another version of the file", jnl.path);
+        else
+        {
+            char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+            {
+                editorSetStatusMessage("No journal, can't read %s: %s", jnl.path, strerror(errno));
+                close(fd);
+                journalClose(0);
+                return;
+            }
+            long long t0 = editorNowMs();
+            int count = 0;
+            E.undoing = 1; // recovered edits are not undone one by one
+            keep = sizeof(head) + journalReplay(map + sizeof(head), map + st.st_size, &count);
+            E.undoing = 0;
+            munmap(map, st.st_size);
+            if (E.cy > E.numrows)
+                E.cy = E.numrows;
+            if (E.cy < E.numrows && E.cx > ROW(E.cy)->size)
+                E.cx = ROW(E.cy)->size;
+            if (count > 0)
+                editorSetStatusMessage("Recovered %d changes from %s in %lld ms",
+                                       count, jnl.path, editorNowMs() - t0);
+        }
+    }
+
+    // drop what was not replayed, a record cut short by a crash included
+    if (keep == 0)
+    {
+        if (ftruncate(fd, 0) == -1 || pwrite(fd, &head, sizeof(head), 0) != sizeof(head) ||
+            fdatasync(fd) == -1)
+            keep = -1;
+        else
+            keep = sizeof(head);
+    }
+    else if (keep > 0 && keep < st.st_size && ftruncate(fd, keep) == -1)
+        keep = -1;
+    if (keep == -1 || lseek(fd, keep, SEEK_SET) == -1)
+    {
+        editorSetStatusMessage("No journal, can't write %s: %s", jnl.path, strerror(errno));
+        close(fd);
+        journalClose(0);
+        return;
+    }
+    jnl.fd = fd;
 }
 
 
 /*** Editor operations ***/
 // These are about the actual visible editor
 
-void editorInsertChar(int c)
+void editorInsertChar(int c)
+{
+    // if on the last line, add a new row to the editor
+    if(E.cy == E.numrows)
+    {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(ROW(E.cy), E.cx, c);
+    E.cx++;
+}
+
+// find the end of the line starting at p: the next \r, \n or end
+static const char* textLineEnd(const char* p, const char* end)
+{
+    while (p < end && *p != '\n' && *p != '\r')
+        p++;
+    return p;
+}
+
+// skip the line break at p (\r\n, \r or \n)
+static const char* textNextLine(const char* p, const char* end)
+{
+    if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n')
+        return p + 2;
+    return p < end ? p + 1 : p;
+}
+
+/* Insert a block of text (a paste) at the cursor. All of its lines are
+opened in E.row at once with editorInsertRows, and the whole block
+counts as one change. */
+void editorInsertText(const char* s, size_t len)
+{
+    const char* end = s + len;
+    const char* p;
+    int dirty = E.dirty;
+
+    int k = 0; // number of line breaks, each one makes a new row
+    for (p = textLineEnd(s, end); p < end; p = textLineEnd(textNextLine(p, end), end))
+        k++;
+
+    if (E.cy == E.numrows)
+    {
+        // past the last row, line breaks alone add rows as Enter does there
+        // and leave the cursor past the end
+        for (p = s; p < end && (*p == '\n' || *p == '\r'); p++)
+            ;
+        if (p == end)
+        {
+            editorInsertRows(E.numrows, k);
+            E.cy = E.numrows;
+            E.dirty = dirty + (k > 0);
+            return;
+        }
+        editorInsertRow(E.numrows, "", 0);
+    }
+
+    const char* first = textLineEnd(s, end);
+    if (k == 0)
+    {
+        editorRowInsertString(ROW(E.cy), E.cx, s, len);
+        E.cx += len;
+        E.dirty = dirty + 1;
+        return;
+    }
+
+    // open k rows below the cursor row in one go
+    editorInsertRows(E.cy + 1, k);
+
+    // every following line gets its own row, rendered when first drawn
+    int i;
+    const char* line = textNextLine(first, end);
+    for (i = 1; i <= k; i++)
+    {
+        const char* eol = textLineEnd(line, end);
+        editorRowSetText(ROW(E.cy + i), line, eol - line);
+        journalAdd(UNDO_INSERT, E.cy + i, 0, eol - line, line);
+        if (i < k)
+            line = textNextLine(eol, end);
+    }
+    int lastlen = ROW(E.cy + k)->size;
+
+    // the text after the cursor moves to the end of the last line
+    erow* row = ROW(E.cy);
+    char* text = editorRowText(row);
+    editorRowAppendString(ROW(E.cy + k), &text[E.cx], row->size - E.cx);
+    editorRowTruncate(row, E.cx);
+    editorRowInsertString(row, E.cx, s, first - s);
+
+    E.cy += k;
+    E.cx = lastlen;
+    E.dirty = dirty + 1;
+}
+
+void editorInsertNewline() 
+{
+    if (E.cx == 0) 
+        editorInsertRow(E.cy, "", 0);
+    else 
+    {
+        // make the new row first, inserting it can move the text of short rows
+        editorInsertRow(E.cy + 1, "", 0);
+        erow *row = ROW(E.cy);
+        char* text = editorRowText(row);
+        editorRowAppendString(ROW(E.cy + 1), &text[E.cx], row->size - E.cx);
+        editorRowTruncate(row, E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar()
+{
+    if(E.cy == E.numrows)
+        return;
+
+    if(E.cy == 0 && E.cx == 0)
+        return;
+    
+    erow *row = ROW(E.cy);
+    if(E.cx>0)
+    {
+        editorRowDelChar(row, E.cx-1);
+        E.cx--;
+    }
+    else
+    {
+        E.cx = ROW(E.cy - 1)->size;
+        editorRowAppendString(ROW(E.cy - 1), editorRowText(row), row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+
+/*** Undo ***/
+// Ctrl-Z and Ctrl-Y over a log of row operations
+
+/* Every row operation adds a record of what it did to E.undo: the text
+that went in or out at a row and column, or the rows inserted, deleted
+or moved. The records of one key press make a step. Characters typed or
+deleted one after the other keep growing the last record, so a typed
+word is a single record. Undo applies the inverse of every record of a
+step, newest first, and redo applies them again, so either costs the
+size of the edit and never a copy of the buffer. Rows that went in are
+only copied out when they are undone, which is when redo needs them.
+The records hold at most E.undomax bytes (--undo MB): the oldest steps
+are dropped first, and a step too big to fit on its own clears the log.
+Rows that do not fit when they are undone leave the step without redo. */
+
+#define UNDO_MAX (64 << 20) // default E.undomax
+
+// bytes held by a record
+#define UNDO_BYTES(rec) (sizeof(undoRec) + (rec)->cap)
+
+static void undoFree(undoRec* rec)
+{
+    E.undobytes -= UNDO_BYTES(rec);
+    memFree(rec->text);
+}
+
+// forget every step
+void undoClear()
+{
+    while (E.nundo > E.undohead)
+        undoFree(&E.undo[--E.nundo]);
+    E.undohead = E.undopos = E.nundo = 0;
+    E.undoopen = 0;
+}
+
+// a key press starts, its edits make a step of their own
+void undoBegin()
+{
+    E.undoopen = 0;
+    E.undolost = 0;
+    E.undocy = E.cy;
+    E.undocx = E.cx;
+}
+
+// the key press is done, redo puts the cursor where it is now
+void undoEnd()
+{
+    if (E.undoopen)
+    {
+        E.undo[E.undostep].ay = E.cy;
+        E.undo[E.undostep].ax = E.cx;
+    }
+    E.undoopen = 0;
+}
+
+static int undoRecording()
+{
+    return E.undomax > 0 && !E.undoing && !E.undolost;
+}
+
+// the open step did not fit: drop the log and the rest of the step
+static void undoOverflow()
+{
+    undoClear();
+    E.undolost = 1;
+}
+
+// drop the oldest steps before record end until need more bytes fit
+static void undoDrop(size_t need, int end)
+{
+    while (E.undobytes + need > E.undomax && E.undohead < end)
+    {
+        do
+            undoFree(&E.undo[E.undohead++]);
+        while (!(E.undo[E.undohead].flags & UNDO_STEP));
+    }
+}
+
+// drop the oldest steps until the log fits again
+static void undoTrim()
+{
+    undoDrop(0, E.undostep);
+    if (E.undobytes > E.undomax)
+    {
+        undoOverflow();
+        return;
+    }
+    // slide the live records down once the dropped ones outnumber them
+    if (E.undohead > 0 && E.undohead >= E.nundo - E.undohead)
+    {
+        memmove(E.undo, &E.undo[E.undohead], sizeof(undoRec) * (E.nundo - E.undohead));
+        E.nundo -= E.undohead;
+        E.undopos -= E.undohead;
+        E.undostep -= E.undohead;
+        E.undohead = 0;
+    }
+}
+
+// a new record with room for len bytes of text, NULL if it can never fit
+static undoRec* undoPush(int op, int y, int x, int n, size_t len)
+{
+    if (sizeof(undoRec) + len > E.undomax)
+    {
+        undoOverflow();
+        return NULL;
+    }
+    // a new edit ends the redo history
+    while (E.nundo > E.undopos)
+        undoFree(&E.undo[--E.nundo]);
+    if (E.nundo == E.undoslots)
+    {
+        E.undoslots = E.undoslots ? 2 * E.undoslots : 64;
+        E.undo = memRealloc(MEM_UNDO, E.undo, sizeof(undoRec) * E.undoslots);
+    }
+
+    undoRec* rec = &E.undo[E.nundo++];
+    E.undopos = E.nundo;
+    rec->op = op;
+    rec->flags = 0;
+    rec->y = y;
+    rec->x = x;
+    rec->n = n;
+    rec->text = len ? memAlloc(MEM_UNDO, len) : NULL;
+    rec->len = rec->cap = len;
+    if (!E.undoopen)
+    {
+        rec->flags = UNDO_STEP;
+        rec->cy = rec->ay = E.undocy;
+        rec->cx = rec->ax = E.undocx;
+        E.undostep = E.nundo - 1;
+        E.undoopen = 1;
+    }
+    E.undobytes += UNDO_BYTES(rec);
+    return rec;
+}
+
+// the last record if it holds characters typed at row y
+static undoRec* undoTyped(int op, int y)
+{
+    if (E.undopos != E.nundo || E.nundo == E.undohead)
+        return NULL;
+    undoRec* rec = &E.undo[E.nundo - 1];
+    if (rec->op != op || !(rec->flags & UNDO_TYPED) || rec->y != y)
+        return NULL;
+    return rec;
+}
+
+// make room for len more characters in the last record and reopen its step
+static void undoJoin(undoRec* rec, int len)
+{
+    if (rec->len + len > rec->cap)
+    {
+        int cap = 2 * rec->cap > rec->len + len ? 2 * rec->cap : rec->len + len;
+        rec->text = memRealloc(MEM_UNDO, rec->text, cap);
+        E.undobytes += cap - rec->cap;
+        rec->cap = cap;
+    }
+    // the step of the record takes this key press too
+    if (!E.undoopen)
+    {
+        E.undostep = E.nundo - 1;
+        while (!(E.undo[E.undostep].flags & UNDO_STEP))
+            E.undostep--;
+        E.undoopen = 1;
+    }
+}
+
+// len characters of s went in at row y, column x
+void undoInsert(int y, int x, const char* s, int len, int typed)
+{
+    if (!undoRecording() || len == 0)
+        return;
+    undoRec* rec = typed ? undoTyped(UNDO_INSERT, y) : NULL;
+    if (rec != NULL && x == rec->x + rec->len)
+        undoJoin(rec, len);
+    else
+    {
+        if ((rec = undoPush(UNDO_INSERT, y, x, 0, len)) == NULL)
+            return;
+        rec->len = 0;
+        rec->flags |= typed ? UNDO_TYPED : 0;
+    }
+    memcpy(&rec->text[rec->len], s, len);
+    rec->len += len;
+    undoTrim();
+}
+
+// len characters of the row from column x are about to go
+void undoDelete(erow* row, int x, int len, int typed)
+{
+    if (!undoRecording() || len == 0)
+        return;
+    int y = editorRowIndex(row);
+    undoRec* rec = typed ? undoTyped(UNDO_DELETE, y) : NULL;
+    if (rec != NULL && x + len == rec->x)
+    {
+        // backspace, the text goes in front
+        undoJoin(rec, len);
+        memmove(&rec->text[len], rec->text, rec->len);
+        editorRowCopy(row, x, len, rec->text);
+        rec->x = x;
+        rec->len += len;
+    }
+    else
+    {
+        if (rec != NULL && x == rec->x)
+            undoJoin(rec, len); // delete, the text goes after
+        else
+        {
+            if ((rec = undoPush(UNDO_DELETE, y, x, 0, len)) == NULL)
+                return;
+            rec->len = 0;
+            rec->flags |= typed ? UNDO_TYPED : 0;
+        }
+        editorRowCopy(row, x, len, &rec->text[rec->len]);
+        rec->len += len;
+    }
+    undoTrim();
+}
+
+// bytes the text of rows [y, y + n) takes in a record
+static size_t undoRowsLen(int y, int n)
+{
+    size_t len = 0;
+    int i;
+    for (i = y; i < y + n; i++)
+        len += sizeof(int) + ROW(i)->size;
+    return len;
+}
+
+// keep the text of the rows of a record, each row as its length and characters
+static void undoSaveRows(undoRec* rec)
+{
+    char* p = rec->text;
+    int i;
+    for (i = rec->y; i < rec->y + rec->n; i++)
+    {
+        erow* row = ROW(i);
+        memcpy(p, &row->size, sizeof(int));
+        p += sizeof(int);
+        editorRowCopy(row, 0, row->size, p);
+        p += row->size;
+    }
+}
+
+// put the rows of a record back
+static void undoPutRows(undoRec* rec)
+{
+    editorInsertRows(rec->y, rec->n);
+    const char* p = rec->text;
+    int i;
+    for (i = rec->y; i < rec->y + rec->n; i++)
+    {
+        int len;
+        memcpy(&len, p, sizeof(int));
+        p += sizeof(int);
+        editorRowSetText(ROW(i), p, len);
+        journalAdd(UNDO_INSERT, i, 0, len, p);
+        p += len;
+    }
+}
+
+// n rows went in at row y, their text is only kept once they are undone
+void undoInsertRows(int y, int n)
+{
+    if (undoRecording() && undoPush(UNDO_INSROWS, y, 0, n, 0) != NULL)
+        undoTrim();
+}
+
+// rows [y, y + n) are about to go
+void undoDeleteRows(int y, int n)
+{
+    if (!undoRecording())
+        return;
+    undoRec* rec = undoPush(UNDO_DELROWS, y, 0, n, undoRowsLen(y, n));
+    if (rec == NULL)
+        return;
+    undoSaveRows(rec);
+    undoTrim();
+}
+
+// rows [from, from + n) moved to start at row to
+void undoMoveRows(int from, int n, int to)
+{
+    if (undoRecording() && undoPush(UNDO_MOVE, from, to, n, 0) != NULL)
+        undoTrim();
+}
+
+/* Apply a record, or its inverse. Returns 0 when rows being undone
+could not be kept for redo. */
+static int undoApply(undoRec* rec, int inverse)
+{
+    switch (rec->op ^ inverse)
+    {
+        case UNDO_INSERT:
+            editorRowInsertString(ROW(rec->y), rec->x, rec->text, rec->len);
+            break;
+        case UNDO_DELETE:
+            editorRowDelString(ROW(rec->y), rec->x, rec->len);
+            break;
+        case UNDO_INSROWS:
+            undoPutRows(rec);
+            break;
+        case UNDO_DELROWS:
+            if (rec->text == NULL && rec->n > 0)
+            {
+                // rows that went in are about to be undone, redo needs them;
+                // older steps make room for them, but not the ones being undone
+                size_t len = undoRowsLen(rec->y, rec->n);
+                int step = rec - E.undo;
+                while (!(E.undo[step].flags & UNDO_STEP))
+                    step--;
+                undoDrop(len, step);
+                if (E.undobytes + len > E.undomax)
+                {
+                    editorDelRows(rec->y, rec->n);
+                    return 0;
+                }
+                rec->len = rec->cap = len;
+                rec->text = memAlloc(MEM_UNDO, rec->cap);
+                E.undobytes += rec->cap;
+                undoSaveRows(rec);
+            }
+            editorDelRows(rec->y, rec->n);
+            break;
+        default:
+            if (inverse)
+                editorMoveRows(rec->x, rec->n, rec->y);
+            else
+                editorMoveRows(rec->y, rec->n, rec->x);
+            break;
+    }
+    return 1;
+}
+
+// put the cursor back on the text after an undo or redo
+static void undoCursor(int cy, int cx)
+{
+    E.cy = cy > E.numrows ? E.numrows : cy;
+    int rowlen = E.cy < E.numrows ? ROW(E.cy)->size : 0;
+    E.cx = cx > rowlen ? rowlen : cx;
+}
+
+void editorUndo()
+{
+    if (E.undopos == E.undohead)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    int redo = 1;
+    E.undoing = 1;
+    do
+        redo &= undoApply(&E.undo[--E.undopos], 1);
+    while (!(E.undo[E.undopos].flags & UNDO_STEP));
+    E.undoing = 0;
+    undoCursor(E.undo[E.undopos].cy, E.undo[E.undopos].cx);
+    if (!redo)
+    {
+        // the step is too big to keep for redo, and so is everything after it
+        while (E.nundo > E.undopos)
+            undoFree(&E.undo[--E.nundo]);
+        editorSetStatusMessage("Undone, too big to redo");
+    }
+}
+
+void editorRedo()
+{
+    if (E.undopos == E.nundo)
+    {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    undoRec* step = &E.undo[E.undopos];
+    E.undoing = 1;
+    do
+        undoApply(&E.undo[E.undopos++], 0);
+    while (E.undopos < E.nundo && !(E.undo[E.undopos].flags & UNDO_STEP));
+    E.undoing = 0;
+    undoCursor(step->ay, step->ax);
+}
+
+
+/*** Append Buffer ***/
+// Kind of like a dynamic buffer
+// The storage only ever grows (doubling), so a buffer that is reset and
+// reused, like the frame buffer, stops allocating once it is big enough.
+
+struct abuf
+{
+    char* b;
+    int len;
+    int cap; // allocated size of b
+    int high; // longest contents seen when the buffer was reset
+}typedef abuf;
+
+#define ABUF_INIT {NULL,0,0,0} // Empty buffer(like a constructor)
+
+// make room for n more bytes
+void abReserve(abuf *ab, int n)
+{
+    if (ab->len + n <= ab->cap)
+        return;
+    int cap = ab->cap ? ab->cap : 1024;
+    while (cap < ab->len + n)
+        cap *= 2;
+    ab->b = memRealloc(MEM_ABUF, ab->b, cap);
+    ab->cap = cap;
+}
+
+// To append the string s to our current buffer
+void abAppend(abuf *ab, const char* s, int len)
+{
+    abReserve(ab, len);
+    memcpy(&ab->b[ab->len],s,len);
+    ab->len += len;
+}
+
+// empty the buffer for reuse, keeping its storage
+void abReset(abuf *ab)
+{
+    if (ab->len > ab->high)
+        ab->high = ab->len;
+    ab->len = 0;
+}
+
+// Like a destructor to free the buffer
+void abFree(abuf *ab)
+{
+    memFree(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+
+
+/*** Screen buffer ***/
+/* E.shadow mirrors what the terminal currently shows. Every screen line
+is composed into E.line first and then compared with its shadow line,
+so a frame only writes a cursor move plus the cells that changed. */
+
+#define ATTR_INVERSE 1
+#define ATTR_MATCH 2
+
+// (re)allocate the shadow for the current window size, forcing a full repaint
+void screenResize()
 {
-    // if on the last line, add a new row to the editor
-    if(E.cy == E.numrows)
-    {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    int cells = (E.screenrows + 2) * E.screencols;
+    memFree(E.shadow);
+    memFree(E.shadowattr);
+    memFree(E.line);
+    memFree(E.lineattr);
+    E.shadow = memAlloc(MEM_SCREEN, cells);
+    E.shadowattr = memAlloc(MEM_SCREEN, cells);
+    E.line = memAlloc(MEM_SCREEN, E.screencols);
+    E.lineattr = memAlloc(MEM_SCREEN, E.screencols);
+    E.shadowvalid = 0;
 }
 
-void editorInsertNewline() 
+// forget what the terminal shows: clear it and start from a blank shadow
+void screenInvalidate(abuf* ab)
 {
-    if (E.cx == 0) 
-        editorInsertRow(E.cy, "", 0);
-    else 
+    int cells = (E.screenrows + 2) * E.screencols;
+    abAppend(ab, "\x1b[2J", 4);
+    memset(E.shadow, ' ', cells);
+    memset(E.shadowattr, 0, cells);
+    E.shadowvalid = 1;
+}
+
+/* When the view moved by fewer lines than the screen holds, shift the text
+area of the terminal (and the shadow with it) inside a scroll region, so
+that only the newly exposed lines differ and get drawn. */
+void screenScroll(abuf* ab)
+{
+    int delta = E.rowoff - E.shadowrowoff;
+    if (delta == 0 || E.coloff != E.shadowcoloff ||
+        delta >= E.screenrows || -delta >= E.screenrows)
+        return;
+
+    int cols = E.screencols;
+    int n = delta > 0 ? delta : -delta;
+    int keep = (E.screenrows - n) * cols;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                       E.screenrows, n, delta > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+
+    if (delta > 0)
     {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        memmove(E.shadow, &E.shadow[n * cols], keep);
+        memmove(E.shadowattr, &E.shadowattr[n * cols], keep);
+        memset(&E.shadow[keep], ' ', n * cols);
+        memset(&E.shadowattr[keep], 0, n * cols);
+    }
+    else
+    {
+        memmove(&E.shadow[n * cols], E.shadow, keep);
+        memmove(&E.shadowattr[n * cols], E.shadowattr, keep);
+        memset(E.shadow, ' ', n * cols);
+        memset(E.shadowattr, 0, n * cols);
     }
-    E.cy++;
-    E.cx = 0;
 }
 
-void editorDelChar()
+// start composing a new screen line
+void lineBegin()
 {
-    if(E.cy == E.numrows)
+    E.linelen = 0;
+}
+
+// add characters to the line being composed, clipped to the screen width
+void lineAppend(const char* s, int len, unsigned char attr)
+{
+    if (len > E.screencols - E.linelen)
+        len = E.screencols - E.linelen;
+    if (len <= 0)
         return;
+    memcpy(&E.line[E.linelen], s, len);
+    memset(&E.lineattr[E.linelen], attr, len);
+    E.linelen += len;
+}
 
-    if(E.cy == 0 && E.cx == 0)
+// add n copies of c, clipped to the screen width
+void lineFill(char c, int n, unsigned char attr)
+{
+    if (n > E.screencols - E.linelen)
+        n = E.screencols - E.linelen;
+    if (n <= 0)
         return;
-    
-    erow *row = &E.row[E.cy];
-    if(E.cx>0)
+    memset(&E.line[E.linelen], c, n);
+    memset(&E.lineattr[E.linelen], attr, n);
+    E.linelen += n;
+}
+
+// change the attributes of columns [from, to) of the line being composed
+void lineSetAttr(int from, int to, unsigned char attr)
+{
+    if (from < 0)
+        from = 0;
+    if (to > E.linelen)
+        to = E.linelen;
+    if (from < to)
+        memset(&E.lineattr[from], attr, to - from);
+}
+
+// a line whose bytes are not all printable ASCII may not map one byte to one column
+static int linePlain(const char* cells, int len)
+{
+    int j;
+    for (j = 0; j < len; j++)
+        if (cells[j] < ' ' || cells[j] > '~')
+            return 0;
+    return 1;
+}
+
+// finish the composed line: write whatever differs from screen line y
+void lineEnd(abuf* ab, int y)
+{
+    int cols = E.screencols;
+    char* old = &E.shadow[y * cols];
+    unsigned char* oldattr = &E.shadowattr[y * cols];
+
+    // the rest of the line is blank
+    memset(&E.line[E.linelen], ' ', cols - E.linelen);
+    memset(&E.lineattr[E.linelen], 0, cols - E.linelen);
+
+    int first = 0;
+    while (first < cols && old[first] == E.line[first] && oldattr[first] == E.lineattr[first])
+        first++;
+    if (first == cols)
+        return;
+    int last = cols - 1;
+    while (old[last] == E.line[last] && oldattr[last] == E.lineattr[last])
+        last--;
+    if (!linePlain(E.line, cols) || !linePlain(old, cols))
     {
-        editorRowDelChar(row, E.cx-1);
-        E.cx--;
+        first = 0;
+        last = cols - 1;
+    }
+
+    // trailing blanks are cleared with a single erase in line
+    int end = cols;
+    while (end > 0 && E.line[end - 1] == ' ' && E.lineattr[end - 1] == 0)
+        end--;
+    if (end > last + 1)
+        end = last + 1;
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, first + 1);
+    abAppend(ab, buf, len);
+
+    unsigned char attr = 0;
+    int j = first;
+    while (j < end)
+    {
+        // write runs of cells sharing the same attributes
+        int run = j;
+        while (run < end && E.lineattr[run] == E.lineattr[j])
+            run++;
+        if (E.lineattr[j] != attr)
+        {
+            // attributes are only ever added, so drop the old ones first
+            if (attr)
+                abAppend(ab, "\x1b[m", 3);
+            attr = E.lineattr[j];
+            if (attr & ATTR_INVERSE)
+                abAppend(ab, "\x1b[7m", 4);
+            if (attr & ATTR_MATCH)
+                abAppend(ab, "\x1b[30;43m", 8);
+        }
+        abAppend(ab, &E.line[j], run - j);
+        j = run;
+    }
+    if (attr)
+        abAppend(ab, "\x1b[m", 3);
+    if (end <= last)
+        abAppend(ab, "\x1b[K", 3);
+
+    memcpy(old, E.line, cols);
+    memcpy(oldattr, E.lineattr, cols);
+}
+
+
+
+/*** Search ***/
+// Ctrl-F incremental search
+
+/* Substrings are found with a first/last byte filter: a block of text is
+compared with the first byte of the needle, the block len - 1 bytes
+further on with its last byte, and only the positions where both match
+are checked with memcmp. On ordinary text that leaves two vector compares
+per block. The widest version the CPU supports is picked at startup. */
+
+// first match of needle in [p, end), NULL if none
+static const char* findTextScalar(const char* p, const char* end, const char* needle, int len)
+{
+    if (end - p < len)
+        return NULL;
+    return memmem(p, end - p, needle, len);
+}
+
+#if defined(__SSE2__)
+static const char* findTextSSE2(const char* p, const char* end, const char* needle, int len)
+{
+    if (len < 2)
+        return findTextScalar(p, end, needle, len);
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[len - 1]);
+    for (; end - p >= 16 + len - 1; p += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int i = __builtin_ctz(mask);
+            if (memcmp(p + i + 1, needle + 1, len - 2) == 0)
+                return p + i;
+            mask &= mask - 1;
+        }
+    }
+    return findTextScalar(p, end, needle, len);
+}
+#endif
+
+#if defined(INDEX_AVX2)
+__attribute__((target("avx2")))
+static const char* findTextAVX2(const char* p, const char* end, const char* needle, int len)
+{
+    if (len < 2)
+        return findTextScalar(p, end, needle, len);
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[len - 1]);
+    for (; end - p >= 32 + len - 1; p += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int i = __builtin_ctz(mask);
+            if (memcmp(p + i + 1, needle + 1, len - 2) == 0)
+                return p + i;
+            mask &= mask - 1;
+        }
+    }
+    return findTextScalar(p, end, needle, len);
+}
+#endif
+
+static const char* (*findText)(const char*, const char*, const char*, int) = findTextScalar;
+
+// pick the substring scanner for this CPU
+void editorInitSearch()
+{
+#if defined(__SSE2__)
+    findText = findTextSSE2;
+#endif
+#if defined(INDEX_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        findText = findTextAVX2;
+#endif
+}
+
+#define FIND_CHUNK (64 * 1024)
+#define FIND_SPAN 65536 // most rows scanned as one block
+
+// last match of needle in [p, end), NULL if none
+// the text is scanned back a chunk at a time so a near match is found quickly
+static const char* findTextLast(const char* p, const char* end, const char* needle, int len)
+{
+    const char* to = end; // matches starting before here are left to look at
+    while (to > p)
+    {
+        const char* from = to - p > FIND_CHUNK ? to - FIND_CHUNK : p;
+        const char* stop = end - to > len - 1 ? to + len - 1 : end;
+        const char* last = NULL;
+        const char* hit;
+        while ((hit = findText(from, stop, needle, len)) != NULL)
+        {
+            last = hit;
+            from = hit + 1;
+        }
+        if (last != NULL)
+            return last;
+        to = to - p > FIND_CHUNK ? to - FIND_CHUNK : p;
+    }
+    return NULL;
+}
+
+/* Rows that are still mapped lie one after the other in E.map with only
+line ends between them. A query never holds a line end, so a run of such
+rows is scanned as one block, and searching a large unedited file costs
+little more than the scan itself. Blocks stop at FIND_SPAN rows so that a
+match nearby is found without walking the whole file first. */
+
+// row y + 1 follows row y in the mapping with nothing but line ends between
+static int editorRowsAdjacent(int y)
+{
+    erow* row = ROW(y);
+    erow* next = ROW(y + 1);
+    if (!ROW_MAPPED(row) || !ROW_MAPPED(next))
+        return 0;
+    const char* p = row->chars.ptr + row->size;
+    if (next->chars.ptr <= p)
+        return 0;
+    while (p < next->chars.ptr && (*p == '\n' || *p == '\r'))
+        p++;
+    return p == next->chars.ptr;
+}
+
+// the row among adjacent rows y..z whose text holds p
+static int editorSpanRow(int y, int z, const char* p)
+{
+    while (y < z)
+    {
+        int mid = y + (z - y + 1) / 2;
+        if (ROW(mid)->chars.ptr <= p)
+            y = mid;
+        else
+            z = mid - 1;
+    }
+    return y;
+}
+
+// put the cursor on a match and highlight it
+static int editorFindMark(int y, const char* hit, int len)
+{
+    E.cy = y;
+    E.cx = hit - ROW_CHARS(ROW(y));
+    E.findrow = E.cy;
+    E.findcol = E.cx;
+    E.findlen = len;
+    return 1;
+}
+
+// first match in rows y..last, starting at column x of row y
+static int editorFindForward(int y, int x, int last, const char* needle, int len)
+{
+    for (; y <= last; y++, x = 0)
+    {
+        int z = y;
+        while (z < last && z - y < FIND_SPAN && editorRowsAdjacent(z))
+            z++;
+        erow* row = ROW(y);
+        const char* text = editorRowText(row);
+        if (x > row->size)
+            x = row->size;
+        const char* hit = findText(text + x, ROW_CHARS(ROW(z)) + ROW(z)->size, needle, len);
+        if (hit != NULL)
+            return editorFindMark(editorSpanRow(y, z, hit), hit, len);
+        y = z;
+    }
+    return 0;
+}
+
+// last match in rows last..y that starts before column x of row y
+static int editorFindBackward(int y, int x, int last, const char* needle, int len)
+{
+    for (; y >= last; y--, x = INT_MAX)
+    {
+        int z = y;
+        while (z > last && y - z < FIND_SPAN && editorRowsAdjacent(z - 1))
+            z--;
+        erow* row = ROW(y);
+        const char* text = editorRowText(row);
+        if (x > row->size)
+            x = row->size;
+        int stop = row->size - x > len - 1 ? x + len - 1 : row->size;
+        const char* hit = findTextLast(ROW_CHARS(ROW(z)), text + stop, needle, len);
+        if (hit != NULL)
+            return editorFindMark(editorSpanRow(z, y, hit), hit, len);
+        y = z;
     }
+    return 0;
+}
+
+/* Move the cursor to the next match of needle, looking from the cursor in
+direction dir (1 or -1) and wrapping around the ends of the file. Going
+forward, skip 1 steps over a match right at the cursor. */
+static int editorFindNext(const char* needle, int len, int dir, int skip)
+{
+    int n = E.numrows;
+    if (n == 0)
+        return E.findlen = 0;
+
+    // the line past the end of the file counts as the end of the last row
+    int y = E.cy < n ? E.cy : n - 1;
+    int x = E.cy < n ? E.cx : ROW(n - 1)->size;
+    int found;
+    if (dir > 0)
+        found = editorFindForward(y, x + skip, n - 1, needle, len) ||
+                editorFindForward(0, 0, y, needle, len);
     else
+        found = editorFindBackward(y, x, 0, needle, len) ||
+                editorFindBackward(n - 1, INT_MAX, y, needle, len);
+    if (!found)
+        E.findlen = 0;
+    return found;
+}
+
+// where the search started, restored when it is cancelled
+static int findcx, findcy, findrowoff, findcoloff;
+
+// called by editorPrompt after every key of the search query
+static void editorFindCallback(char* query, int key)
+{
+    if (key == '\r' || key == '\x1b')
     {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        E.findlen = 0;
+        if (key == '\x1b')
+        {
+            E.cx = findcx;
+            E.cy = findcy;
+            E.rowoff = findrowoff;
+            E.coloff = findcoloff;
+        }
+        return;
+    }
+
+    // arrows step between matches, anything else changed the query
+    int dir = 1, skip = 0;
+    if (key == ARROW_RIGHT || key == ARROW_DOWN)
+        skip = 1;
+    else if (key == ARROW_LEFT || key == ARROW_UP)
+        dir = -1;
+
+    int len = strlen(query);
+    if (len == 0)
+    {
+        E.findlen = 0;
+        return;
     }
+    editorFindNext(query, len, dir, skip);
 }
 
+void editorFind()
+{
+    findcx = E.cx;
+    findcy = E.cy;
+    findrowoff = E.rowoff;
+    findcoloff = E.coloff;
+    char* query = editorPrompt("Search: %s (ESC to cancel, arrows for next/previous)",
+                               editorFindCallback);
+    free(query);
+}
 
-/*** Append Buffer ***/
-// Kind of like a dynamic buffer
 
-struct abuf
+/*** Search all ***/
+// Ctrl-A counts and highlights every match, scanning on worker threads
+
+/* E.row is cut into one slice per worker. Each worker scans its slice the
+same way editorFindForward does and keeps its matches in a private
+array, so the slices are merged in order at the end by concatenation.
+The arrays grow in blocks claimed from one shared budget, so all of
+them together keep at most FINDALL_KEEP matches.
+Workers only read row text, sizes and caps, none of which change while
+the UI thread waits for them: it only repaints the screen, runs the
+progress timer and watches for Esc. Keys typed meanwhile stay in the
+input ring for the main loop. Repainting may render rows, which
+writes their flags, so workers tell inline rows by their cap instead.
+Counters are published with atomics for the timer to read. Worker arrays come from plain
+realloc since the memAlloc counters are not thread safe. */
+
+#define FINDALL_KEEP (1 << 20) // match positions kept by all workers, every match is counted
+#define FINDALL_MIN_ROWS 16384 // rows per worker before another one is worth it
+#define FINDALL_TICK 100 // ms between progress updates
+
+struct findPart {
+    int first, last; // rows first..last
+    findMatch* found;
+    size_t nfound, cap;
+    int full; // the budget ran out, matches are only counted
+    size_t count; // matches so far, atomic
+    int rowsdone; // atomic
+    int done; // atomic
+} typedef findPart;
+
+// ROW_CHARS without looking at the flags
+#define FINDALL_CHARS(row) ((row)->cap == ROW_INLINE_CAP ? (row)->chars.buf : (row)->chars.ptr)
+
+static findPart findparts[INDEX_MAX_THREADS];
+static int nfindparts;
+static const char* findneedle;
+static int findneedlelen;
+static int findcancel; // atomic, set by Esc
+static size_t findclaimed; // atomic, slots of FINDALL_KEEP handed out to workers
+
+static void* editorFindAllWorker(void* arg)
 {
-    char* b;
-    int len;
-}typedef abuf;
+    findPart* part = arg;
+    const char* needle = findneedle;
+    int len = findneedlelen;
+    size_t count = 0;
+    int y = part->first;
+    while (y <= part->last && !__atomic_load_n(&findcancel, __ATOMIC_RELAXED))
+    {
+        int z = y;
+        while (z < part->last && z - y < FIND_SPAN && editorRowsAdjacent(z))
+            z++;
+        const char* p = FINDALL_CHARS(ROW(y));
+        const char* end = FINDALL_CHARS(ROW(z)) + ROW(z)->size;
+        const char* hit;
+        int at = y;
+        while ((hit = findText(p, end, needle, len)) != NULL)
+        {
+            at = editorSpanRow(at, z, hit);
+            if (part->nfound == part->cap && !part->full)
+            {
+                // claim another block from the budget all workers share
+                size_t want = part->cap ? part->cap : 256;
+                size_t from = __atomic_fetch_add(&findclaimed, want, __ATOMIC_RELAXED);
+                if (from >= FINDALL_KEEP)
+                    part->full = 1;
+                else
+                {
+                    if (want > FINDALL_KEEP - from)
+                        want = FINDALL_KEEP - from;
+                    part->cap += want;
+                    part->found = realloc(part->found, sizeof(findMatch) * part->cap);
+                    if (part->found == NULL)
+                        die("realloc");
+                }
+            }
+            if (part->nfound < part->cap)
+            {
+                part->found[part->nfound].row = at;
+                part->found[part->nfound].col = hit - FINDALL_CHARS(ROW(at));
+                part->nfound++;
+            }
+            count++;
+            p = hit + len;
+        }
+        y = z + 1;
+        __atomic_store_n(&part->count, count, __ATOMIC_RELAXED);
+        __atomic_store_n(&part->rowsdone, y - part->first, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&part->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-#define ABUF_INIT {NULL,0} // Empty buffer(like a constructor)
+// how many workers to split E.row between
+static int editorSearchThreads()
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = E.numrows / FINDALL_MIN_ROWS;
+    if (n > ncpu)
+        n = ncpu;
+    if (n > INDEX_MAX_THREADS)
+        n = INDEX_MAX_THREADS;
+    if (n < 1)
+        n = 1;
+    return n;
+}
 
-// To append the string s to our current buffer
-void abAppend(abuf *ab, const char* s, int len)
+// put the running match count in the message bar
+static void editorFindAllProgress()
+{
+    size_t count = 0;
+    long rows = 0;
+    int i;
+    for (i = 0; i < nfindparts; i++)
+    {
+        count += __atomic_load_n(&findparts[i].count, __ATOMIC_RELAXED);
+        rows += __atomic_load_n(&findparts[i].rowsdone, __ATOMIC_RELAXED);
+    }
+    editorSetStatusMessage("Finding all: %zu matches, %ld%% (ESC to cancel)",
+                           count, rows * 100 / E.numrows);
+}
+
+static int editorFindAllDone()
+{
+    int i;
+    for (i = 0; i < nfindparts; i++)
+        if (!__atomic_load_n(&findparts[i].done, __ATOMIC_ACQUIRE))
+            return 0;
+    return 1;
+}
+
+/* Take an Esc typed during the scan out of the input ring and return 1;
+the keys around it are left for editorReadKey. Keys are decoded in place
+the way editorReadKey does, skipping over a whole bracketed paste. */
+static int editorFindAllEsc()
+{
+    inputFill();
+    unsigned head = inhead;
+    int used = 0, key, esc = 0;
+    while (!esc && inputPending())
+    {
+        used = inputDecode(&key);
+        if (used == 0)
+        {
+            // half an escape sequence, or the escape key
+            if (editorWaitInput(ESC_SEQ_TIMEOUT) && inputFill() > 0)
+                continue;
+            used = 1;
+            key = '\x1b';
+        }
+        if (key == '\x1b')
+            esc = 1;
+        else if (key == PASTE_START)
+        {
+            // the paste ends with ESC [ 201 ~, stop at a paste not all here yet
+            unsigned i = used, len = INPUT_LEN();
+            while (i + 6 <= len && !(INPUT_AT(i) == '\x1b' && INPUT_AT(i + 1) == '[' &&
+                                     INPUT_AT(i + 2) == '2' && INPUT_AT(i + 3) == '0' &&
+                                     INPUT_AT(i + 4) == '1' && INPUT_AT(i + 5) == '~'))
+                i++;
+            if (i + 6 > len)
+                break;
+            inhead += i + 6;
+        }
+        else
+            inhead += used;
+    }
+    if (esc)
+    {
+        // close up the ring over the Esc
+        unsigned i, rest = INPUT_LEN() - used;
+        for (i = 0; i < rest; i++)
+            INPUT_AT(i) = INPUT_AT(i + used);
+        intail -= used;
+    }
+    inhead = head;
+    return esc;
+}
+
+// index of the first kept match at or after row y, column x
+static size_t editorFindAllAt(int y, int x)
 {
-    // allocate enough memory to hold new string
-    char* new = realloc(ab->b,ab->len + len);
+    size_t lo = 0, hi = E.nfound;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (E.found[mid].row < y || (E.found[mid].row == y && E.found[mid].col < x))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    if( new == NULL)
+void editorFindAll()
+{
+    char* query = editorPrompt("Find all: %s (ESC to cancel)", NULL);
+    if (query == NULL)
         return;
-    
-    memcpy(&new[ab->len],s,len);
-    ab->b = new;
-    ab->len += len;
+    E.nfound = 0;
+    if (E.numrows == 0)
+    {
+        editorSetStatusMessage("No matches");
+        free(query);
+        return;
+    }
+
+    // workers read rows as plain text, so no gap may be left open
+    if (E.gaprow != -1)
+        editorRowText(ROW(E.gaprow));
+
+    int n = editorSearchThreads();
+    findneedle = query;
+    findneedlelen = strlen(query);
+    findcancel = 0;
+    findclaimed = 0;
+    nfindparts = n;
+    pthread_t tid[INDEX_MAX_THREADS];
+    int started[INDEX_MAX_THREADS];
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        findPart* part = &findparts[i];
+        memset(part, 0, sizeof(*part));
+        part->first = (long long)E.numrows * i / n;
+        part->last = (long long)E.numrows * (i + 1) / n - 1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        started[i] = pthread_create(&tid[i], NULL, editorFindAllWorker, &findparts[i]) == 0;
+        if (!started[i])
+            editorFindAllWorker(&findparts[i]);
+    }
+
+    // stay responsive while the workers run, Esc stops them
+    int timer = editorAddTimer(FINDALL_TICK, editorFindAllProgress);
+    editorFindAllProgress();
+    while (!editorFindAllDone())
+    {
+        editorRefreshScreen();
+        if (INPUT_LEN() == INPUT_BUF_SIZE)
+        {
+            // no room to read further, wait for the workers
+            poll(NULL, 0, FINDALL_TICK);
+            editorFindAllProgress();
+        }
+        else if (editorWaitEvent(FINDALL_TICK) && editorFindAllEsc())
+            __atomic_store_n(&findcancel, 1, __ATOMIC_RELAXED);
+    }
+    editorRemoveTimer(timer);
+
+    size_t count = 0, kept = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (started[i])
+            pthread_join(tid[i], NULL);
+        count += findparts[i].count;
+        kept += findparts[i].nfound;
+    }
+
+    // the slices are in row order, so merging is concatenation
+    if (!findcancel)
+    {
+        E.found = memRealloc(MEM_SEARCH, E.found, sizeof(findMatch) * (kept ? kept : 1));
+        for (i = 0; i < n; i++)
+        {
+            memcpy(&E.found[E.nfound], findparts[i].found, sizeof(findMatch) * findparts[i].nfound);
+            E.nfound += findparts[i].nfound;
+        }
+        E.foundlen = findneedlelen;
+    }
+    for (i = 0; i < n; i++)
+        free(findparts[i].found);
+    nfindparts = 0;
+
+    if (findcancel)
+        editorSetStatusMessage("Find all cancelled");
+    else if (count == 0)
+        editorSetStatusMessage("No matches for \"%s\"", query);
+    else
+    {
+        // go to the first match from the cursor on, wrapping around
+        size_t at = editorFindAllAt(E.cy, E.cx);
+        if (at == E.nfound)
+            at = 0;
+        E.cy = E.found[at].row;
+        E.cx = E.found[at].col;
+        editorSetStatusMessage("%zu matches for \"%s\"%s", count, query,
+                               kept < count ? " (not all highlighted)" : "");
+    }
+    free(query);
 }
 
-// Like a destructor to free the buffer
-void abFree(abuf *ab)
+
+/*** Replace all ***/
+// Ctrl-R replaces every match in one pass over the buffer
+
+/* Workers take a slice of E.row each, as in find all. A row with matches
+is rebuilt once into the worker's output buffer, copying the kept text
+and the replacements in order; rows without a match are not copied at
+all. The UI thread then swaps the rebuilt lines into their rows, which
+get rendered again only when drawn. */
+
+struct replaceEdit {
+    int row;
+    int len;
+    size_t off; // in the out buffer of the part
+} typedef replaceEdit;
+
+struct replacePart {
+    int first, last; // rows first..last
+    char* out; // rebuilt lines, back to back
+    size_t outlen, outcap;
+    replaceEdit* edits;
+    size_t nedits, editcap;
+    long count;
+} typedef replacePart;
+
+static const char* replold;
+static const char* replnew;
+static int reploldlen, replnewlen;
+static int replspans; // rows may be scanned as blocks, old holds no line ends
+
+static void replaceOut(replacePart* part, const char* s, size_t len)
+{
+    if (len == 0)
+        return;
+    if (part->outlen + len > part->outcap)
+    {
+        size_t cap = part->outcap ? part->outcap : 4096;
+        while (cap < part->outlen + len)
+            cap *= 2;
+        part->out = realloc(part->out, cap);
+        if (part->out == NULL)
+            die("realloc");
+        part->outcap = cap;
+    }
+    memcpy(&part->out[part->outlen], s, len);
+    part->outlen += len;
+}
+
+static void* editorReplaceWorker(void* arg)
+{
+    replacePart* part = arg;
+    int y = part->first;
+    while (y <= part->last)
+    {
+        int z = y;
+        while (replspans && z < part->last && z - y < FIND_SPAN && editorRowsAdjacent(z))
+            z++;
+        const char* end = FINDALL_CHARS(ROW(z)) + ROW(z)->size;
+        const char* hit = findText(FINDALL_CHARS(ROW(y)), end, replold, reploldlen);
+        int at = y;
+        while (hit != NULL)
+        {
+            // rebuild the row holding this match with all of its matches
+            at = editorSpanRow(at, z, hit);
+            const char* p = FINDALL_CHARS(ROW(at));
+            const char* rowend = p + ROW(at)->size;
+            size_t off = part->outlen;
+            while (hit != NULL && hit < rowend)
+            {
+                replaceOut(part, p, hit - p);
+                replaceOut(part, replnew, replnewlen);
+                part->count++;
+                p = hit + reploldlen;
+                hit = findText(p, end, replold, reploldlen);
+            }
+            replaceOut(part, p, rowend - p);
+
+            if (part->nedits == part->editcap)
+            {
+                part->editcap = part->editcap ? part->editcap * 2 : 256;
+                part->edits = realloc(part->edits, sizeof(replaceEdit) * part->editcap);
+                if (part->edits == NULL)
+                    die("realloc");
+            }
+            part->edits[part->nedits].row = at;
+            part->edits[part->nedits].off = off;
+            part->edits[part->nedits].len = part->outlen - off;
+            part->nedits++;
+        }
+        y = z + 1;
+    }
+    return NULL;
+}
+
+// replace every old in the buffer by new, returns the number replaced
+long editorReplaceAll(const char* old, int oldlen, const char* new, int newlen)
 {
-    free(ab->b);
+    if (E.numrows == 0 || oldlen == 0)
+        return 0;
+    if (E.gaprow != -1)
+        editorRowText(ROW(E.gaprow));
+
+    replold = old;
+    reploldlen = oldlen;
+    replnew = new;
+    replnewlen = newlen;
+    replspans = memchr(old, '\n', oldlen) == NULL && memchr(old, '\r', oldlen) == NULL;
+
+    int n = editorSearchThreads();
+    replacePart parts[INDEX_MAX_THREADS];
+    pthread_t tid[INDEX_MAX_THREADS];
+    int started[INDEX_MAX_THREADS];
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        memset(&parts[i], 0, sizeof(parts[i]));
+        parts[i].first = (long long)E.numrows * i / n;
+        parts[i].last = (long long)E.numrows * (i + 1) / n - 1;
+    }
+    for (i = 1; i < n; i++)
+        started[i] = pthread_create(&tid[i], NULL, editorReplaceWorker, &parts[i]) == 0;
+    editorReplaceWorker(&parts[0]);
+
+    // one record stands for all the rows changed here
+    journalReplace(old, oldlen, new, newlen);
+    jnl.off++;
+    long count = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (i > 0 && started[i])
+            pthread_join(tid[i], NULL);
+        else if (i > 0)
+            editorReplaceWorker(&parts[i]);
+
+        size_t j;
+        for (j = 0; j < parts[i].nedits; j++)
+        {
+            replaceEdit* edit = &parts[i].edits[j];
+            editorRowReplaceText(ROW(edit->row), &parts[i].out[edit->off], edit->len);
+        }
+        count += parts[i].count;
+        free(parts[i].out);
+        free(parts[i].edits);
+    }
+    jnl.off--;
+
+    if (count > 0)
+        E.dirty++;
+    if (E.cy < E.numrows && E.cx > ROW(E.cy)->size)
+        E.cx = ROW(E.cy)->size;
+    return count;
 }
 
+void editorReplace()
+{
+    char* old = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+    if (old == NULL)
+        return;
+    char* new = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (new == NULL)
+    {
+        free(old);
+        return;
+    }
+
+    long long t0 = editorNowUs();
+    long count = editorReplaceAll(old, strlen(old), new, strlen(new));
+    long long ms = (editorNowUs() - t0) / 1000;
+    if (count == 0)
+        editorSetStatusMessage("No matches for \"%s\"", old);
+    else
+        editorSetStatusMessage("Replaced %ld occurrences in %lld ms", count, ms);
+    free(old);
+    free(new);
+}
 
 
 /*** Input/Keypress handling ***/
 
 
-char *editorPrompt(char *prompt) 
+/* Read a line in the status bar. The callback, if any, sees the text
+after every key, including the final Enter or Esc. */
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) 
 {
     size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+    char *buf = memAlloc(MEM_PROMPT, bufsize);
     size_t buflen = 0;
     buf[0] = '\0';
     while (1) 
@@ -576,28 +4306,54 @@ char *editorPrompt(char *prompt)
         else if(c == '\x1b')
         {
             editorSetStatusMessage("");
-            free(buf);
+            if (callback)
+                callback(buf, c);
+            memFree(buf);
             return NULL;
         }
         else if (c == '\r') 
         {
             if (buflen != 0) 
             {
+                // the answer outlives the prompt, hand out a plain copy
                 editorSetStatusMessage("");
-                return buf;
+                if (callback)
+                    callback(buf, c);
+                char* answer = strdup(buf);
+                memFree(buf);
+                return answer;
+            }
+        } 
+        else if (c == PASTE)
+        {
+            // keep the printable part of a paste
+            size_t j;
+            for (j = 0; j < pastelen; j++)
+            {
+                if (iscntrl((unsigned char)pastebuf[j]))
+                    continue;
+                if (buflen == bufsize - 1)
+                {
+                    bufsize *= 2;
+                    buf = memRealloc(MEM_PROMPT, buf, bufsize);
+                }
+                buf[buflen++] = pastebuf[j];
+                buf[buflen] = '\0';
             }
-        } 
+        }
         else if (!iscntrl(c) && c < 128) 
         {
             // increase the size of the buffer dynamically
             if (buflen == bufsize - 1) 
             {
                 bufsize *= 2;
-                buf = realloc(buf, bufsize);
+                buf = memRealloc(MEM_PROMPT, buf, bufsize);
             }
             buf[buflen++] = c;
             buf[buflen] = '\0';
         }
+        if (callback)
+            callback(buf, c);
     }
 }
 
@@ -605,7 +4361,7 @@ char *editorPrompt(char *prompt)
 // Function for cursor movement handling
 void editorMoveCursor(int key) 
 {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : ROW(E.cy);
     switch (key) 
     {
         case ARROW_LEFT:
@@ -616,7 +4372,7 @@ void editorMoveCursor(int key)
             else if(E.cy > 0)
             {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = ROW(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -642,7 +4398,7 @@ void editorMoveCursor(int key)
             break;
     }
 
-    row = (E.cy > E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : ROW(E.cy);
     int rowlen = row ? row->size : 0;
     if(E.cx > rowlen)
         E.cx = rowlen;
@@ -655,6 +4411,7 @@ void editorProcessKeypress()
     static int quit_times = KILO_QUIT_TIMES;
     int c = editorReadKey();
 
+    undoBegin();
     switch (c)
     {
         case '\r':
@@ -668,6 +4425,7 @@ void editorProcessKeypress()
                 quit_times--;
                 return;
             }
+            journalClose(1);
             write(STDOUT_FILENO,"\x1b[2J",4);
             write(STDOUT_FILENO,"\x1b[H",3);
             exit(0);
@@ -690,6 +4448,10 @@ void editorProcessKeypress()
                     E.cy = E.rowoff + E.screenrows - 1;
                     if (E.cy > E.numrows) E.cy = E.numrows;
                 }
+                // keep the cursor inside the row it landed on
+                int rowlen = E.cy < E.numrows ? ROW(E.cy)->size : 0;
+                if (E.cx > rowlen)
+                    E.cx = rowlen;
             }
             break;
 
@@ -698,7 +4460,7 @@ void editorProcessKeypress()
             break;
         case END_KEY:
             if (E.cy < E.numrows)
-                E.cx = E.row[E.cy].size;
+                E.cx = ROW(E.cy)->size;
             break;
 
         case BACKSPACE:
@@ -709,7 +4471,46 @@ void editorProcessKeypress()
             editorDelChar();
             break;
 
+        case CTRL_KEY('f'):
+            editorFind();
+            break;
+
+        case CTRL_KEY('a'):
+            editorFindAll();
+            break;
+
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case CTRL_KEY('t'):
+            // live and peak heap use of every subsystem
+            memSummary(E.statusmsg, sizeof(E.statusmsg));
+            E.statusmsg_time = time(NULL);
+            break;
+
+        case CTRL_KEY('p'):
+            // performance HUD in place of the status bar
+            E.hud = !E.hud;
+            break;
+
         case CTRL_KEY('l'):
+            // repaint the whole screen in case the terminal got garbled
+            E.shadowvalid = 0;
+            break;
+
         case '\x1b':
             break;
 
@@ -717,24 +4518,32 @@ void editorProcessKeypress()
             editorSave();
             break;
 
+        case PASTE:
+            editorInsertText(pastebuf, pastelen);
+            break;
+
         default:
             editorInsertChar(c);
             break;
     }
+    undoEnd();
     quit_times = KILO_QUIT_TIMES;
 }
 
 
 /*** Output ***/
 
+static abuf frame = ABUF_INIT; // reused by every frame
+
 void editorDrawMessageBar(struct  abuf *ab)
 {
-    abAppend(ab, "\x1b[K", 3);
+    lineBegin();
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) 
         msglen = E.screencols;
     // if (msglen && time(NULL) - E.statusmsg_time < 500)
-    abAppend(ab, E.statusmsg, msglen);
+    lineAppend(E.statusmsg, msglen, 0);
+    lineEnd(ab, E.screenrows + 1);
 }
 
 // Custom printf type function for displaying message
@@ -747,39 +4556,58 @@ void editorSetStatusMessage(const char *fmt, ...)
     E.statusmsg_time = time(NULL);
 }
 
+// the status bar with the performance HUD on: numbers of the last frame
+static void editorDrawHud()
+{
+    char hud[160];
+    double mb = 1024.0 * 1024.0;
+    int len = snprintf(hud, sizeof(hud),
+                       "draw %lldus lag %lldus out %zu/%dB rd %lu wr %lu rows %.1fM slab %.1fM/%.1fM"
+                       " waste %.1fM %.0f%%",
+                       E.renderus, E.latencyus, E.framebytes, frame.high, E.nreads, E.nwrites,
+                       (E.rowcap * sizeof(erow) + slab.st.used) / mb,
+                       slab.st.used / mb, slab.st.reserved / mb,
+                       slab.st.wasted / mb, slabFragmentation() * 100);
+    if (len >= (int)sizeof(hud))
+        len = sizeof(hud) - 1;
+    if (len > E.screencols)
+        len = E.screencols;
+    lineAppend(hud, len, ATTR_INVERSE);
+    lineFill(' ', E.screencols - len, ATTR_INVERSE);
+}
+
 void editorDrawStatusBar(struct abuf* ab)
 {
     // inverting colors
-    abAppend(ab, "\x1b[7m", 4);
+    lineBegin();
+    if (E.hud)
+    {
+        editorDrawHud();
+        lineEnd(ab, E.screenrows);
+        return;
+    }
     char status[80], rstatus[80];
 
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                             E.filename ? E.filename : "[No Name]", E.numrows,
                             E.dirty ? "(modified)" : "");
     // for the rendering
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-                E.cy + 1, E.numrows);
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d @%lld",
+                E.cy + 1, E.numrows, editorRowOffset(E.cy) + E.cx);
 
     if (len > E.screencols) 
         len = E.screencols;
-    abAppend(ab, status, len);
+    lineAppend(status, len, ATTR_INVERSE);
 
-    while(len < E.screencols)
+    // pad, with the position right aligned if it fits
+    if (E.screencols - len >= rlen)
     {
-        if (E.screencols - len == rlen) 
-        {
-            abAppend(ab, rstatus, rlen);
-            break;
-        }
-        else
-        {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+        lineFill(' ', E.screencols - len - rlen, ATTR_INVERSE);
+        lineAppend(rstatus, rlen, ATTR_INVERSE);
     }
-    // reverse the inversion
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    else
+        lineFill(' ', E.screencols - len, ATTR_INVERSE);
+    lineEnd(ab, E.screenrows);
 }
 
 
@@ -787,7 +4615,7 @@ void editorScroll()
 {
     E.rx = 0;
     if(E.cy < E.numrows)
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(ROW(E.cy), E.cx);
 
     if (E.cy < E.rowoff) 
     {
@@ -810,9 +4638,11 @@ void editorScroll()
 // To mark each row in our editor
 void editorDrawRows(abuf *ab)
 {
+    editorEvictRenders(E.rowoff - RENDER_KEEP, E.rowoff + E.screenrows + RENDER_KEEP);
     for(int i=0;i<E.screenrows;i++)
     {
         int filerow = i + E.rowoff;
+        lineBegin();
         if(filerow>=E.numrows)
         {
             // Display the welcome message
@@ -828,21 +4658,23 @@ void editorDrawRows(abuf *ab)
                 int padding = (E.screencols - welcomelen)/2;
                 if(padding)
                 {
-                    abAppend(ab,"~",1);
+                    lineAppend("~",1,0);
                     padding--;
                 }
-                while(padding--)
-                    abAppend(ab," ",1);
+                lineFill(' ', padding, 0);
 
 
-                abAppend(ab, welcome, welcomelen);
+                lineAppend(welcome, welcomelen, 0);
             }
             else
-                abAppend(ab,"~",1);
+                lineAppend("~",1,0);
         }
         else
         {
-            int len = E.row[filerow].rsize - E.coloff;
+            // rows are rendered the first time they become visible
+            char* render = editorRowRender(ROW(filerow));
+
+            int len = ROW(filerow)->rsize - E.coloff;
 
             if(len < 0)
                 len = 0;
@@ -851,42 +4683,607 @@ void editorDrawRows(abuf *ab)
             if(len > E.screencols)
                 len = E.screencols;
 
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
-        }
-        // escape sequence to clear a line
-        abAppend(ab, "\x1b[K", 3);
+            lineAppend(&render[E.coloff], len, 0);
 
-        // if(i<E.screenrows-1)
-        abAppend(ab,"\r\n",2);
+            size_t m;
+            for (m = E.nfound ? editorFindAllAt(filerow, 0) : 0;
+                 m < E.nfound && E.found[m].row == filerow; m++)
+            {
+                erow* row = ROW(filerow);
+                lineSetAttr(editorRowCxToRx(row, E.found[m].col) - E.coloff,
+                            editorRowCxToRx(row, E.found[m].col + E.foundlen) - E.coloff,
+                            ATTR_MATCH);
+            }
+            if (E.findlen && filerow == E.findrow)
+            {
+                erow* row = ROW(filerow);
+                lineSetAttr(editorRowCxToRx(row, E.findcol) - E.coloff,
+                            editorRowCxToRx(row, E.findcol + E.findlen) - E.coloff,
+                            ATTR_MATCH);
+            }
+        }
+        // write only what changed on this screen line
+        lineEnd(ab, i);
     }
 }
 
 
 
-// To clear screen and put cursor at the start of the editor
+// append the numbers of the frame just painted to the --metrics file
+static void editorWriteMetrics()
+{
+    fprintf(E.metrics, "%lu,%lld,%lld,%lld,%zu,%lu,%lu,%zu,%zu,%zu\n",
+            E.frames, editorNowMs(), E.renderus, E.latencyus, E.framebytes,
+            E.nreads, E.nwrites, E.rowcap * sizeof(erow) + slab.st.used,
+            slab.st.used, slab.st.reserved);
+}
+
+// Bring the terminal up to date, writing only the cells that changed
 void editorRefreshScreen()
 {
+    int timed = E.hud || E.metrics;
+    long long t0 = timed ? editorNowUs() : 0;
     editorScroll();
-    abuf ab = ABUF_INIT;
+    abuf* ab = &frame;
+    abReset(ab);
 
     // escape sequence for hiding the cursor
-    abAppend(&ab, "\x1b[?25l", 6);
-    // moving the cursor to the top left so that tilde can be printed correctly from start
-    abAppend(&ab,"\x1b[H",3);
+    abAppend(ab, "\x1b[?25l", 6);
+    if (!E.shadowvalid)
+        screenInvalidate(ab);
+    else
+        screenScroll(ab);
+    E.shadowrowoff = E.rowoff;
+    E.shadowcoloff = E.coloff;
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorDrawRows(ab);
+    editorDrawStatusBar(ab);
+    editorDrawMessageBar(ab);
 
     // Displaying the cursor at the required location
-    char buff[24];
+    char buff[32];
     snprintf(buff,sizeof(buff),"\x1b[%d;%dH",E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
-    abAppend(&ab, buff, strlen(buff));
+    abAppend(ab, buff, strlen(buff));
+
+
+    abAppend(ab, "\x1b[?25h", 6);
+    long long t1 = timed ? editorNowUs() : 0;
+    // without a terminal (--bench) the frame is only measured
+    if (!E.headless)
+    {
+        write(STDOUT_FILENO,ab->b,ab->len);
+        E.nwrites++;
+    }
+    E.framebytes = ab->len;
+    E.outbytes += ab->len;
+    E.frames++;
+
+    if (timed)
+    {
+        E.renderus = t1 - t0;
+        if (E.inputus)
+        {
+            E.latencyus = editorNowUs() - E.inputus;
+            E.inputus = 0;
+        }
+        if (E.metrics)
+            editorWriteMetrics();
+    }
+}
+
+
+/*** Script ***/
+// Headless batch editing: app --script SCRIPT FILE
+
+/* A script holds one command per line and runs straight against E.row,
+with no terminal and no screen updates. Blank lines and lines starting
+with '#' are skipped. TEXT may use \n, \t and \\.
+
+    goto LINE [COL]     move the cursor, both 1-based
+    insert TEXT         insert TEXT at the cursor and move past it
+    delete [N]          delete N characters after the cursor (default 1),
+                        a line break counts as one
+    move N LINE         move N lines from the cursor on so that they
+                        start at LINE, the cursor goes with them
+    find TEXT           move the cursor to the next TEXT at or after it
+    replace /OLD/NEW/   replace every OLD in the file (any delimiter)
+    save [FILE]         write the buffer out, to FILE if given
+
+The script stops at the first command that fails and its exit status
+says why. */
+
+#define SCRIPT_OK 0
+#define SCRIPT_IO 1 // the script or the file could not be read or saved
+#define SCRIPT_SYNTAX 2 // bad usage, unknown command or bad argument
+#define SCRIPT_FAILED 3 // goto past the end, find/replace found nothing
+
+// decode the escapes of s in place, returns the new length
+static int scriptUnescape(char* s, int len)
+{
+    int i, n = 0;
+    for (i = 0; i < len; i++)
+    {
+        char c = s[i];
+        if (c == '\\' && i + 1 < len)
+        {
+            c = s[++i];
+            if (c == 'n')
+                c = '\n';
+            else if (c == 't')
+                c = '\t';
+        }
+        s[n++] = c;
+    }
+    return n;
+}
+
+// move the cursor to the first pat at or after it
+static int scriptFind(const char* pat, int len)
+{
+    int y;
+    for (y = E.cy; y < E.numrows; y++)
+    {
+        erow* row = ROW(y);
+        int from = y == E.cy ? E.cx : 0;
+        if (row->size - from < len)
+            continue;
+        char* text = editorRowText(row);
+        const char* hit = findText(&text[from], text + row->size, pat, len);
+        if (hit != NULL)
+        {
+            E.cy = y;
+            E.cx = hit - text;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// delete n characters after the cursor, returns how many were there
+static long scriptDelete(long n)
+{
+    long done = 0;
+    while (done < n && E.cy < E.numrows)
+    {
+        erow* row = ROW(E.cy);
+        if (E.cx < row->size)
+        {
+            // a run of characters inside the row goes in one step
+            long k = row->size - E.cx;
+            if (k > n - done)
+                k = n - done;
+            editorRowDelString(row, E.cx, k);
+            done += k;
+        }
+        else if (E.cy + 1 < E.numrows)
+        {
+            // rows the count covers whole go in one step, each with the
+            // line break before it
+            int m = 0;
+            long k = 0;
+            while (E.cy + 1 + m < E.numrows && ROW(E.cy + 1 + m)->size + 1 <= n - done - k)
+            {
+                k += ROW(E.cy + 1 + m)->size + 1;
+                m++;
+            }
+            if (m > 0)
+            {
+                editorDelRows(E.cy + 1, m);
+                done += k;
+                continue;
+            }
+            // the line break, join the next row onto this one
+            erow* next = ROW(E.cy + 1);
+            editorRowAppendString(row, editorRowText(next), next->size);
+            editorDelRow(E.cy + 1);
+            done++;
+        }
+        else
+            break;
+    }
+    return done;
+}
+
+// run one command of a script, returns a SCRIPT_ status
+static int scriptCommand(char* line, int len, const char** err)
+{
+    char* arg = line;
+    while (arg < line + len && *arg != ' ')
+        arg++;
+    int cmdlen = arg - line;
+    if (arg < line + len)
+        arg++;
+    int arglen = line + len - arg;
+
+    if (cmdlen == 4 && strncmp(line, "goto", 4) == 0)
+    {
+        long y, x = 1;
+        int n = sscanf(arg, "%ld %ld", &y, &x);
+        if (n < 1 || y < 1 || x < 1)
+        {
+            *err = "goto needs LINE [COL]";
+            return SCRIPT_SYNTAX;
+        }
+        // one past the last line is where text gets appended
+        if (y > E.numrows + 1)
+        {
+            *err = "no such line";
+            return SCRIPT_FAILED;
+        }
+        E.cy = y - 1;
+        E.cx = 0;
+        if (E.cy < E.numrows)
+            E.cx = x - 1 > ROW(E.cy)->size ? ROW(E.cy)->size : x - 1;
+    }
+    else if (cmdlen == 6 && strncmp(line, "insert", 6) == 0)
+    {
+        arglen = scriptUnescape(arg, arglen);
+        editorInsertText(arg, arglen);
+    }
+    else if (cmdlen == 6 && strncmp(line, "delete", 6) == 0)
+    {
+        long n = 1;
+        if (arglen > 0 && (sscanf(arg, "%ld", &n) != 1 || n < 0))
+        {
+            *err = "delete needs a count";
+            return SCRIPT_SYNTAX;
+        }
+        scriptDelete(n);
+    }
+    else if (cmdlen == 4 && strncmp(line, "move", 4) == 0)
+    {
+        long n, y;
+        if (sscanf(arg, "%ld %ld", &n, &y) != 2 || n < 1 || y < 1)
+        {
+            *err = "move needs N LINE";
+            return SCRIPT_SYNTAX;
+        }
+        if (n > E.numrows - E.cy || y - 1 > E.numrows - n)
+        {
+            *err = "no such line";
+            return SCRIPT_FAILED;
+        }
+        editorMoveRows(E.cy, n, y - 1);
+        E.cy = y - 1;
+        E.cx = 0;
+    }
+    else if (cmdlen == 4 && strncmp(line, "find", 4) == 0)
+    {
+        arglen = scriptUnescape(arg, arglen);
+        if (arglen == 0)
+        {
+            *err = "find needs TEXT";
+            return SCRIPT_SYNTAX;
+        }
+        if (!scriptFind(arg, arglen))
+        {
+            *err = "not found";
+            return SCRIPT_FAILED;
+        }
+    }
+    else if (cmdlen == 7 && strncmp(line, "replace", 7) == 0)
+    {
+        // /OLD/NEW/ with the first character as the delimiter
+        char* old = arg + 1;
+        char* mid = arglen > 0 ? memchr(old, arg[0], arglen - 1) : NULL;
+        if (mid == NULL || mid == old)
+        {
+            *err = "replace needs /OLD/NEW/";
+            return SCRIPT_SYNTAX;
+        }
+        char* new = mid + 1;
+        char* stop = memchr(new, arg[0], arg + arglen - new);
+        if (stop == NULL)
+            stop = arg + arglen;
+        int oldlen = scriptUnescape(old, mid - old);
+        int newlen = scriptUnescape(new, stop - new);
+        if (editorReplaceAll(old, oldlen, new, newlen) == 0)
+        {
+            *err = "not found";
+            return SCRIPT_FAILED;
+        }
+    }
+    else if (cmdlen == 4 && strncmp(line, "save", 4) == 0)
+    {
+        if (arglen > 0)
+        {
+            free(E.filename);
+            E.filename = strndup(arg, arglen);
+        }
+        if (editorSave() == -1)
+        {
+            *err = E.statusmsg;
+            return SCRIPT_IO;
+        }
+    }
+    else
+    {
+        *err = "unknown command";
+        return SCRIPT_SYNTAX;
+    }
+    return SCRIPT_OK;
+}
+
+// open filename and apply the script to it, returns the exit status
+int editorRunScript(const char* script, const char* filename)
+{
+    E.headless = 1;
+    initEditor();
+    editorInitLineIndex();
+    editorInitSearch();
+    E.undomax = 0; // a script has no use for undo
+
+    FILE* fp = fopen(script, "r");
+    if (fp == NULL)
+    {
+        perror(script);
+        return SCRIPT_IO;
+    }
+    editorOpen((char*)filename);
+
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int lineno = 0;
+    int status = SCRIPT_OK;
+    while (status == SCRIPT_OK && (linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        lineno++;
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        if (linelen == 0 || line[0] == '#')
+            continue;
+
+        const char* err = NULL;
+        status = scriptCommand(line, linelen, &err);
+        if (status != SCRIPT_OK)
+            fprintf(stderr, "%s:%d: %s\n", script, lineno, err);
+    }
+    if (status == SCRIPT_OK && ferror(fp))
+    {
+        perror(script);
+        status = SCRIPT_IO;
+    }
+    free(line);
+    fclose(fp);
+    return status;
+}
+
+
+/*** Benchmark ***/
+// app --bench SIZE [TRACE...]: replay keystrokes against a synthetic file
+
+/* A file of SIZE bytes (1K, 10M, 1G, ...) of log-like lines is written to
+a temp file and opened as usual. Every trace is then replayed one key at
+a time through editorProcessKeypress and editorRefreshScreen, with the
+input ring fed from the trace and each frame kept in memory instead of
+being written out. Traces are raw terminal input, as a terminal would
+send it. Without TRACE arguments a built-in set runs: typing, paste,
+scroll, page down, save and an incremental search left open at the end.
+A trace must not quit the editor; one that ends in a prompt gets Esc.
+The results go to stdout as one JSON object. */
+
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+
+static int benchCompare(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// "10M" and the like in bytes, -1 if it can't be read
+static long long benchParseSize(const char* s)
+{
+    char* end;
+    long long n = strtoll(s, &end, 10);
+    switch (*end)
+    {
+        case 'K': case 'k': n <<= 10; end++; break;
+        case 'M': case 'm': n <<= 20; end++; break;
+        case 'G': case 'g': n <<= 30; end++; break;
+    }
+    return end == s || *end != '\0' || n < 0 ? -1 : n;
+}
+
+// fill fd with size bytes of log lines, some with tabs and some without
+static int benchWriteFile(int fd, long long size)
+{
+    static char block[1 << 16];
+    int len = 0;
+    int i;
+    for (i = 0; len < (int)sizeof(block) - 128; i++)
+        len += snprintf(&block[len], sizeof(block) - len,
+                        i % 4 ? "2026-01-01 00:%02d:%02d.%03d INFO worker-%d: request %d done in %d ms\n"
+                              : "2026-01-01 00:%02d:%02d.%03d WARN\tworker-%d:\trequest %d slow\t%d ms\n",
+                        i / 60 % 60, i % 60, i % 1000, i % 16, i, i % 97);
+
+    while (size > 0)
+    {
+        struct iovec iov;
+        iov.iov_base = block;
+        iov.iov_len = size < len ? size : len;
+        if (writevAll(fd, &iov, 1) == -1)
+            return -1;
+        size -= len;
+    }
+    return 0;
+}
+
+static void benchKeys(abuf* t, const char* keys, int times)
+{
+    int i;
+    for (i = 0; i < times; i++)
+        abAppend(t, keys, strlen(keys));
+}
+
+// the built-in trace called name
+static void benchTrace(abuf* t, const char* name)
+{
+    int i;
+    if (strcmp(name, "typing") == 0)
+    {
+        for (i = 0; i < 40; i++)
+            benchKeys(t, "the quick brown fox jumps over the lazy dog\r", 1);
+    }
+    else if (strcmp(name, "paste") == 0)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            abAppend(t, "\x1b[200~", 6);
+            benchKeys(t, "pasted line of text\twith a tab in the middle of it\n", 80);
+            abAppend(t, "\x1b[201~", 6);
+        }
+    }
+    else if (strcmp(name, "scroll") == 0)
+        benchKeys(t, "\x1b[B", 2000);
+    else if (strcmp(name, "pagedown") == 0)
+        benchKeys(t, "\x1b[6~", 500);
+    else if (strcmp(name, "save") == 0)
+        benchKeys(t, "x\x13", 3);
+    else if (strcmp(name, "search") == 0)
+        benchKeys(t, "\x06request 4", 1); // the trace ends with the prompt open
+}
+
+// print s as a JSON string
+static void benchPrintString(const char* s)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+// replay one trace, one frame per key, and print its results
+static void benchReplay(const char* name, const char* trace, size_t len)
+{
+    tracebuf = trace;
+    tracelen = len;
+    tracepos = 0;
+
+    double* lat = NULL;
+    int n = 0, cap = 0;
+    size_t bytes = 0, maxbytes = 0;
+    inputFill();
+    while (inputPending())
+    {
+        double t0 = editorNowUs();
+        editorProcessKeypress();
+        editorScroll();
+        editorRefreshScreen();
+        double t1 = editorNowUs();
+
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            lat = realloc(lat, sizeof(double) * cap);
+            if (lat == NULL)
+                die("realloc");
+        }
+        lat[n++] = t1 - t0;
+        bytes += E.framebytes;
+        if (E.framebytes > maxbytes)
+            maxbytes = E.framebytes;
+        inputFill();
+    }
+    tracebuf = NULL;
+
+    // nearest rank percentiles
+    qsort(lat, n, sizeof(double), benchCompare);
+    double p50 = n ? lat[(n * 50 + 99) / 100 - 1] : 0;
+    double p99 = n ? lat[(n * 99 + 99) / 100 - 1] : 0;
+    double max = n ? lat[n - 1] : 0;
+    printf("{\"name\": ");
+    benchPrintString(name);
+    printf(", \"keys\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, "
+           "\"frame_bytes_avg\": %.1f, \"frame_bytes_max\": %zu}",
+           n, p50, p99, max, n ? (double)bytes / n : 0.0, maxbytes);
+    free(lat);
+}
+
+// run the benchmark, returns the exit status
+int editorRunBench(const char* size, int ntraces, char** traces)
+{
+    long long bytes = benchParseSize(size);
+    if (bytes < 0)
+    {
+        fprintf(stderr, "bad size: %s\n", size);
+        return 2;
+    }
+
+    E.headless = 1;
+    initEditor();
+    editorInitLineIndex();
+    editorInitSearch();
+    E.screenrows = BENCH_ROWS - 2;
+    E.screencols = BENCH_COLS;
+    screenResize();
+
+    const char* dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/app-bench-XXXXXX", dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1 || benchWriteFile(fd, bytes) == -1 || close(fd) == -1)
+    {
+        perror(path);
+        if (fd != -1)
+            unlink(path);
+        return 1;
+    }
+
+    double t0 = editorNowUs();
+    editorOpen(path);
+    double load = editorNowUs() - t0;
+    printf("{\"size\": %lld, \"lines\": %d, \"load_ms\": %.1f, \"traces\": [",
+           bytes, E.numrows, load / 1000);
 
+    static const char* builtin[] = { "typing", "paste", "scroll", "pagedown", "save", "search" };
+    int n = ntraces ? ntraces : (int)(sizeof(builtin) / sizeof(builtin[0]));
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        abuf t = ABUF_INIT;
+        abReserve(&t, 1); // an empty trace too, a NULL tracebuf means the terminal
+        const char* name;
+        if (ntraces)
+        {
+            name = traces[i];
+            FILE* fp = fopen(name, "r");
+            if (fp == NULL)
+            {
+                perror(name);
+                unlink(path);
+                return 1;
+            }
+            char chunk[4096];
+            size_t k;
+            while ((k = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+                abAppend(&t, chunk, k);
+            fclose(fp);
+        }
+        else
+        {
+            name = builtin[i];
+            benchTrace(&t, name);
+        }
+        if (i > 0)
+            printf(", ");
+        benchReplay(name, t.b, t.len);
+        abFree(&t);
+    }
 
-    abAppend(&ab, "\x1b[?25h", 6);
-    write(STDOUT_FILENO,ab.b,ab.len);
-    abFree(&ab);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("], \"frames\": %lu, \"peak_rss_kb\": %ld}\n", E.frames, ru.ru_maxrss);
+    unlink(path);
+    return 0;
 }
 
 
@@ -900,37 +5297,151 @@ void initEditor()
     E.rx = 0;
     E.numrows = 0;
     E.row = NULL;
+    E.rowgap = E.rowcap = 0;
+    E.gaprow = -1;
+    E.rlo = E.rhi = 0;
+    E.map = NULL;
+    E.maplen = 0;
+    E.mapsame = 0;
+    E.diskexact = 0;
+    E.disksize = 0;
+    E.firstdirty = INT_MAX;
+    E.rowsmoved = 0;
+    E.dirtyrows = NULL;
+    E.ndirtyrows = 0;
+    E.dirtyrowscap = 0;
     E.rowoff = 0;
     E.coloff = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.dirty = 0;
-
+    E.shadow = NULL;
+    E.shadowattr = NULL;
+    E.line = NULL;
+    E.lineattr = NULL;
+    E.framebytes = 0;
+    E.outbytes = 0;
+    E.frames = 0;
+    E.hud = 0;
+    E.metrics = NULL;
+    E.inputus = 0;
+    E.renderus = 0;
+    E.latencyus = 0;
+    E.nreads = 0;
+    E.nwrites = 0;
+    E.undomax = UNDO_MAX;
+
+    // no terminal to size in --script mode
+    if (E.headless)
+        return;
 
     if(getWindowSize(&E.screenrows,&E.screencols) == -1)
         die("getWindowSize");
     E.screenrows -= 2; // setting screen rows to -2 so that our application thinks there are two lesser lines and we can use it for the status bar
+    screenResize();
     
 }
 
 
 int main(int argc, char* argv[])
 {
+    if (argc >= 2 && strcmp(argv[1], "--script") == 0)
+    {
+        if (argc != 4)
+        {
+            fprintf(stderr, "usage: %s --script SCRIPT FILE\n", argv[0]);
+            return SCRIPT_SYNTAX;
+        }
+        return editorRunScript(argv[2], argv[3]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    {
+        if (argc < 3)
+        {
+            fprintf(stderr, "usage: %s --bench SIZE [TRACE...]\n", argv[0]);
+            return 2;
+        }
+        return editorRunBench(argv[2], argc - 3, &argv[3]);
+    }
+
+    char* filename = NULL;
+    FILE* metrics = NULL;
+    size_t undomax = UNDO_MAX;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        // --metrics FILE appends one CSV line per frame
+        if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+        {
+            metrics = fopen(argv[++i], "a");
+            struct stat st;
+            if (metrics == NULL || fstat(fileno(metrics), &st) == -1)
+            {
+                perror(argv[i]);
+                return 1;
+            }
+            // a line per frame, readable while the editor runs
+            setvbuf(metrics, NULL, _IOLBF, 0);
+            if (st.st_size == 0)
+                fprintf(metrics, "frame,time_ms,render_us,latency_us,bytes,reads,writes,row_bytes,slab_used,slab_reserved\n");
+        }
+        // --memstats FILE writes the heap use of every subsystem at exit
+        else if (strcmp(argv[i], "--memstats") == 0 && i + 1 < argc)
+        {
+            memdump = fopen(argv[++i], "a");
+            if (memdump == NULL)
+            {
+                perror(argv[i]);
+                return 1;
+            }
+            atexit(memDump);
+        }
+        // --undo MB caps the memory of the undo log, 0 turns undo off
+        else if (strcmp(argv[i], "--undo") == 0 && i + 1 < argc)
+        {
+            char* end;
+            errno = 0;
+            long mb = strtol(argv[++i], &end, 10);
+            if (errno != 0 || end == argv[i] || *end != '\0' || mb < 0 || (size_t)mb > SIZE_MAX >> 20)
+            {
+                fprintf(stderr, "%s: --undo takes a size in MB\n", argv[i]);
+                return 1;
+            }
+            undomax = (size_t)mb << 20;
+        }
+        else
+            filename = argv[i];
+    }
+
     enableRawMode();
     initEditor();
+    editorInitLineIndex();
+    editorInitSearch();
+    editorInitEvents();
+    E.metrics = metrics;
+    E.undomax = undomax;
 
-    if(argc >= 2)
-        editorOpen(argv[1]);
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-P = perf HUD");
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit");
+    if(filename != NULL)
+        editorOpen(filename);
 
-    // reading text input in the termial 1 byte at a time
-    // stdin by default it the shell/terminal
+    // the event loop: sleep in poll() until a key, a resize or a timer
+    // needs us; all the keys that arrived together are applied before
+    // a single repaint
     while(1)
     {
         editorRefreshScreen();
-        editorProcessKeypress();
+        if (editorWaitEvent(-1) && inputFill() > 0)
+        {
+            while (inputPending())
+            {
+                editorProcessKeypress();
+                // keep the view in step so Page Up/Down see the right offset
+                editorScroll();
+            }
+        }
     }
     return 0;
 }